@@ -2,7 +2,14 @@
 #include <vector>
 #include <stdexcept>
 #include <string>
-#include <map>
+#include <deque>
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <random>
 using namespace std;
 
 enum VehicleSize {
@@ -53,12 +60,37 @@ public:
     virtual void drive() override {}
 };
 
+const int SIZE_COUNT = 3;
+const int MAX_LEVELS = 256;
+const int LEVEL_WORDS = MAX_LEVELS / 64;
+// A ticket index is the level number above the slot number
+const int LEVEL_SLOT_BITS = 16;
+// Occupancy history kept per level, one bucket per minute
+const int MINUTES_KEPT = 24 * 60;
+// Stays are counted in buckets ending at these lengths in minutes, the last one open-ended
+const int DWELL_LIMITS[] = {15, 30, 60, 120, 240, 480, 1440};
+const int DWELL_BUCKETS = sizeof(DWELL_LIMITS) / sizeof(DWELL_LIMITS[0]) + 1;
+
 class Slot {
     int id;
     VehicleSize sz;
+    // Walking distance from the level entrance; nearer slots are handed out first
+    int distance;
     Vehicle* vehicle;
 public:
-    Slot(int id, VehicleSize s): id(id), sz(s), vehicle(nullptr) {}
+    Slot(int id, VehicleSize s, int d): id(id), sz(s), distance(d), vehicle(nullptr) {}
+
+    int getId() {
+        return id;
+    }
+
+    VehicleSize getSize() {
+        return sz;
+    }
+
+    int getDistance() {
+        return distance;
+    }
 
     bool isEmpty() {
         return vehicle == nullptr;
@@ -77,75 +109,208 @@ public:
 
 class PricingStrategy {
 public:
-    virtual double getCost(VehicleSize sz, string entryTime, string exitTime) = 0;
+    // Times are epoch seconds
+    virtual double getCost(VehicleSize sz, int64_t entryTime, int64_t exitTime) = 0;
 };
 
-class FixedPricingStrategy {
+class FixedPricingStrategy: public PricingStrategy {
+    double rates[SIZE_COUNT];
 public:
-    virtual double getCost(VehicleSize sz, string entryTime, string exitTime) {};
+    FixedPricingStrategy(double small, double medium, double large): rates{small, medium, large} {}
+
+    virtual double getCost(VehicleSize sz, int64_t entryTime, int64_t exitTime) override {
+        return rates[sz];
+    }
 };
 
+int64_t epochSeconds() {
+    return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Tickets are not allocated per visit: every slot owns one entry in the ticket slab, which
+// is reissued with a new generation each time the slot is taken
 class Ticket {
-    static int ids;
-    int id;
-    int level;
-    Vehicle* vh;
-    int slot;
-    string entryTime;
-    string exitTime;
-    double cost;
+    uint32_t generation;
+    VehicleSize sz;
     TicketStatus status;
+    int64_t entryTime;
+    int64_t exitTime;
+    double cost;
 public:
-    Ticket(Vehicle* v, int s, string et, int l): id(ids++), vh(v), slot(s), entryTime(et), cost(0), 
-        exitTime(""), level(l), status(TicketStatus::ISSUED) {}
-
-
-    int getID() {}
-
-    int getLevel() {}
+    Ticket(): generation(0), sz(VehicleSize::SMALL), status(TicketStatus::PAID), entryTime(0), exitTime(0), cost(0) {}
+
+    uint32_t issue(VehicleSize s, int64_t et) {
+        generation++;
+        sz = s;
+        status = TicketStatus::ISSUED;
+        entryTime = et;
+        exitTime = 0;
+        cost = 0;
+        return generation;
+    }
 
-    int getSlot() {}
+    bool isActive(uint32_t gen) {
+        return generation == gen && status == TicketStatus::ISSUED;
+    }
 
-    VehicleSize getSize() {}
+    VehicleSize getSize() {
+        return sz;
+    }
 
-    string getEntryTime() {}
+    int64_t getEntryTime() {
+        return entryTime;
+    }
 
-    void exitVehicle(string et, double c) {
+    void exitVehicle(int64_t et, double c) {
         exitTime = et;
         cost = c;
         status = TicketStatus::PAID;
     }
 };
 
-int Ticket::ids = 1;
+// What Park hands out: the slab entry and the generation it was issued under, so a ticket
+// that was already paid, or whose slot has since been reissued, is rejected
+struct TicketHandle {
+    uint32_t index;
+    uint32_t generation;
 
-class SlotSelectionStrategy {
-public:
-    virtual int getSlotForVehicle(VehicleSize sz, vector<Slot*> slots) = 0;
+    bool valid() {
+        return generation != 0;
+    }
+
+    int getLevel() {
+        return index >> LEVEL_SLOT_BITS;
+    }
+
+    int getSlot() {
+        return index & ((1 << LEVEL_SLOT_BITS) - 1);
+    }
 };
 
-class NearestSlotSelectionStrategy {
+ostream& operator<<(ostream& os, TicketHandle h) {
+    if(!h.valid()) return os<<"none";
+    return os<<h.getLevel()<<"-"<<h.getSlot()<<"#"<<h.generation;
+}
+
+// Free slots of one size as a bitmap, bit k standing for the k-th nearest slot of that
+// size. A summary word marks which bitmap words still have a free bit, so finding the
+// nearest free slot is two count-trailing-zeros for up to 4096 slots per size.
+class FreeSlotBitmap {
+    vector<uint64_t> words;
+    vector<uint64_t> summary;
+    int count;
 public:
-    virtual int getSlotForVehicle(VehicleSize sz, vector<Slot*> slots) {}
+    FreeSlotBitmap(int n = 0): words((n + 63) / 64, 0), summary((words.size() + 63) / 64, 0), count(0) {
+        for(int i=0;i<n;i++) {
+            release(i);
+        }
+    }
+
+
+    // -1 if nothing is free
+    int first() {
+        for(size_t s=0;s<summary.size();s++) {
+            if(summary[s] == 0) continue;
+            size_t w = s * 64 + __builtin_ctzll(summary[s]);
+            return w * 64 + __builtin_ctzll(words[w]);
+        }
+        return -1;
+    }
+
+    void claim(int bit) {
+        size_t w = bit / 64;
+        words[w] &= ~(1ULL << (bit % 64));
+        if(words[w] == 0) summary[w / 64] &= ~(1ULL << (w % 64));
+        count--;
+    }
+
+    void release(int bit) {
+        size_t w = bit / 64;
+        words[w] |= 1ULL << (bit % 64);
+        summary[w / 64] |= 1ULL << (w % 64);
+        count++;
+    }
+
+    int freeCount() {
+        return count;
+    }
 };
 
-class Level {
-    vector<Slot*> slots;
-    SlotSelectionStrategy* strategy;
+// Per-size free bitmaps of one level plus the rank <-> slot id mapping they are laid out in
+class FreeSlotIndex {
+    FreeSlotBitmap bitmaps[SIZE_COUNT];
+    vector<int> slotAtRank[SIZE_COUNT];
+    vector<int> rankOfSlot;
 public:
-    Level() {
-        slots.resize(100);
-        for(int i=0;i<50;i++){
-            auto slt = new Slot(i, VehicleSize::SMALL);
+    FreeSlotIndex(vector<Slot>& slots): rankOfSlot(slots.size()) {
+        for(auto& s:slots) {
+            slotAtRank[s.getSize()].push_back(s.getId());
         }
+        for(int sz=0;sz<SIZE_COUNT;sz++) {
+            auto& order = slotAtRank[sz];
+            stable_sort(order.begin(), order.end(), [&slots](int a, int b) { return slots[a].getDistance() < slots[b].getDistance(); });
+            for(int r=0;r<(int)order.size();r++) {
+                rankOfSlot[order[r]] = r;
+            }
+            bitmaps[sz] = FreeSlotBitmap(order.size());
+        }
+    }
+
+    // Nearest free slot of exactly this size, or -1
+    int nearest(VehicleSize sz) {
+        int rank = bitmaps[sz].first();
+        return rank < 0 ? -1 : slotAtRank[sz][rank];
+    }
 
-        for(int i=50;i<80;i++){
-            auto slt = new Slot(i, VehicleSize::MEDIUM);
+    void claim(VehicleSize sz, int slotId) {
+        bitmaps[sz].claim(rankOfSlot[slotId]);
+    }
+
+    void release(VehicleSize sz, int slotId) {
+        bitmaps[sz].release(rankOfSlot[slotId]);
+    }
+
+    int freeCount(VehicleSize sz) {
+        return bitmaps[sz].freeCount();
+    }
+};
+
+class SlotSelectionStrategy {
+public:
+    // Returns a free slot id able to hold the vehicle, or -1
+    virtual int getSlotForVehicle(VehicleSize sz, FreeSlotIndex& freeSlots) = 0;
+};
+
+// Nearest slot of the vehicle's size, falling back to the nearest larger one
+class NearestSlotSelectionStrategy: public SlotSelectionStrategy {
+public:
+    virtual int getSlotForVehicle(VehicleSize sz, FreeSlotIndex& freeSlots) override {
+        for(int s=sz;s<SIZE_COUNT;s++) {
+            int slot = freeSlots.nearest((VehicleSize)s);
+            if(slot != -1) return slot;
         }
+        return -1;
+    }
+};
 
-        for(int i=80;i<100;i++){
-            auto slt = new Slot(i, VehicleSize::LARGE);
+// Park and unPark do not lock; ParkingLot holds getLock() around them so it can update its
+// availability index in the same critical section
+class Level {
+    vector<Slot> slots;
+    FreeSlotIndex* freeSlots;
+    SlotSelectionStrategy* strategy;
+    mutex mtx;
+public:
+    // Slots are numbered small, then medium, then large; distance follows the slot number
+    Level(int small = 50, int medium = 30, int large = 20) {
+        int n = small + medium + large;
+        slots.reserve(n);
+        for(int i=0;i<n;i++){
+            VehicleSize sz = i < small ? VehicleSize::SMALL : (i < small + medium ? VehicleSize::MEDIUM : VehicleSize::LARGE);
+            slots.emplace_back(i, sz, i);
         }
+        freeSlots = new FreeSlotIndex(slots);
+        strategy = new NearestSlotSelectionStrategy();
     }
 
     void SetStrategy(SlotSelectionStrategy* st){
@@ -153,37 +318,269 @@ public:
     }
 
     int Park(Vehicle* vh) {
-        int slotNumber = strategy->getSlotForVehicle(vh->getSize(), slots);
-        slots[slotNumber]->fillSlot(vh);
+        int slotNumber = strategy->getSlotForVehicle(vh->getSize(), *freeSlots);
+        if(slotNumber == -1) return -1;
+        slots[slotNumber].fillSlot(vh);
+        freeSlots->claim(slots[slotNumber].getSize(), slotNumber);
         return slotNumber;
     }
 
     void unPark(int slotNumber) {
-        slots[slotNumber]->emptySlot();
+        slots[slotNumber].emptySlot();
+        freeSlots->release(slots[slotNumber].getSize(), slotNumber);
+    }
+
+    VehicleSize getSlotSize(int slotNumber) {
+        return slots[slotNumber].getSize();
+    }
+
+    int freeCount(VehicleSize sz) {
+        return freeSlots->freeCount(sz);
+    }
+
+    int getSlotCount() {
+        return slots.size();
+    }
+
+    mutex& getLock() {
+        return mtx;
     }
 };
 
+// Levels that still have a free slot of one size. A bit only changes under that level's
+// lock but is read without it, so a gate can act on a stale bit and must re-check.
+class LevelMask {
+    atomic<uint64_t> words[LEVEL_WORDS];
+public:
+    LevelMask() {
+        for(auto& w:words) w.store(0, memory_order_relaxed);
+    }
+
+    void set(int level) {
+        words[level >> 6].fetch_or(1ULL << (level & 63));
+    }
+
+    void clear(int level) {
+        words[level >> 6].fetch_and(~(1ULL << (level & 63)));
+    }
+
+    // First marked level at or after start, wrapping around
+    int firstFrom(int start) {
+        for(int i=0;i<=LEVEL_WORDS;i++) {
+            int w = ((start >> 6) + i) % LEVEL_WORDS;
+            uint64_t bits = words[w].load(memory_order_acquire);
+            if(i == 0) bits &= ~0ULL << (start & 63);
+            else if(i == LEVEL_WORDS) bits &= (1ULL << (start & 63)) - 1;
+            if(bits) return w * 64 + __builtin_ctzll(bits);
+        }
+        return -1;
+    }
+};
+
+// One level's occupancy per slot size over the last MINUTES_KEPT minutes. Park and unPark
+// add to the current minute's bucket, and queries add up buckets, so the cost of a query
+// depends on the length of its range and not on how many vehicles came through. Callers
+// hold the level's lock.
+class OccupancyLog {
+    struct Bucket {
+        // The minute this ring entry holds; entries left over from an earlier day are reset on use
+        int64_t minute = -1;
+        int opening = 0;
+        int peak = 0;
+        uint32_t arrivals = 0;
+        uint32_t departures = 0;
+        int64_t dwellSeconds = 0;
+        uint32_t dwell[DWELL_BUCKETS] = {};
+    };
+    vector<Bucket> buckets;
+    int occupied[SIZE_COUNT];
+    // Events are kept in minute order; one that arrives late from a slow gate counts towards
+    // the latest minute
+    int64_t lastMinute;
+
+    Bucket& at(int64_t minute, VehicleSize sz) {
+        return buckets[(minute % MINUTES_KEPT) * SIZE_COUNT + sz];
+    }
+
+    Bucket& current(VehicleSize sz, int64_t time) {
+        lastMinute = max(lastMinute, time / 60);
+        Bucket& b = at(lastMinute, sz);
+        if(b.minute != lastMinute) {
+            b = Bucket();
+            b.minute = lastMinute;
+            b.opening = b.peak = occupied[sz];
+        }
+        return b;
+    }
+
+    static int dwellBucket(int64_t seconds) {
+        int i = 0;
+        while(i < DWELL_BUCKETS - 1 && seconds >= DWELL_LIMITS[i] * 60) i++;
+        return i;
+    }
+
+    // The retained minutes within [from, to]
+    int64_t firstMinute(int64_t from) {
+        return max(from / 60, lastMinute - MINUTES_KEPT + 1);
+    }
+
+    int64_t lastMinuteOf(int64_t to) {
+        return min(to / 60, lastMinute);
+    }
+public:
+    OccupancyLog(): buckets(MINUTES_KEPT * SIZE_COUNT), occupied{}, lastMinute(0) {}
+
+    void recordArrival(VehicleSize sz, int64_t time) {
+        Bucket& b = current(sz, time);
+        b.arrivals++;
+        b.peak = max(b.peak, ++occupied[sz]);
+    }
+
+    void recordDeparture(VehicleSize sz, int64_t time, int64_t dwellSeconds) {
+        Bucket& b = current(sz, time);
+        occupied[sz]--;
+        b.departures++;
+        b.dwellSeconds += dwellSeconds;
+        b.dwell[dwellBucket(dwellSeconds)]++;
+    }
+
+    // Most slots of this size taken at once during [from, to]
+    int peak(VehicleSize sz, int64_t from, int64_t to) {
+        int best = -1;
+        int64_t last = lastMinuteOf(to);
+        for(int64_t m=firstMinute(from);m<=last;m++) {
+            Bucket& b = at(m, sz);
+            if(b.minute != m) continue;
+            if(best == -1) best = b.opening;
+            best = max(best, b.peak);
+        }
+        if(best != -1) return best;
+        // Nothing moved during the range, so it held what the next change started from
+        for(int64_t m=max(last + 1, firstMinute(0));m<=lastMinute;m++) {
+            Bucket& b = at(m, sz);
+            if(b.minute == m) return b.opening;
+        }
+        return occupied[sz];
+    }
+
+    // Mean stay in seconds of the vehicles that left during [from, to], 0 if none did
+    double averageDwell(VehicleSize sz, int64_t from, int64_t to) {
+        uint64_t departures = 0;
+        int64_t seconds = 0;
+        for(int64_t m=firstMinute(from);m<=lastMinuteOf(to);m++) {
+            Bucket& b = at(m, sz);
+            if(b.minute != m) continue;
+            departures += b.departures;
+            seconds += b.dwellSeconds;
+        }
+        return departures == 0 ? 0 : (double)seconds / departures;
+    }
+
+    // Departures during [from, to] by length of stay, bucketed by DWELL_LIMITS
+    vector<uint64_t> turnover(VehicleSize sz, int64_t from, int64_t to) {
+        vector<uint64_t> histogram(DWELL_BUCKETS, 0);
+        for(int64_t m=firstMinute(from);m<=lastMinuteOf(to);m++) {
+            Bucket& b = at(m, sz);
+            if(b.minute != m) continue;
+            for(int i=0;i<DWELL_BUCKETS;i++) {
+                histogram[i] += b.dwell[i];
+            }
+        }
+        return histogram;
+    }
+};
+
+// Safe to call Park and unPark from many gates at once. Each level has its own lock, which
+// also guards that level's tickets, and the availability index is atomic, so gates only
+// wait on each other when they pick the same level.
 class ParkingLot {
-    vector<Level*> levels;
-    map<int, Ticket*> tickets;
+    Level* levels[MAX_LEVELS];
+    atomic<int> levelCount;
+    mutex addLevelMtx;
+    // The ticket slab, one array per level indexed by slot number, so memory is bounded by
+    // the number of slots and redeeming a ticket is a direct lookup
+    Ticket* tickets[MAX_LEVELS];
+    OccupancyLog* occupancy[MAX_LEVELS];
+    // Garage-wide free slots per size, and per size a mask of the levels that have one, so
+    // an arriving vehicle goes straight to a level with room and a full lot is turned away
+    // without visiting any level
+    atomic<int> freeBySize[SIZE_COUNT];
+    LevelMask levelsWithSpace[SIZE_COUNT];
 
     PricingStrategy* strategy;
     // SlotSelectionStrategy* strategy;
-    ParkingLot(int n) {
-        levels.resize(n);
+    ParkingLot(int n): levelCount(0), freeBySize{} {
+        for(int i=0;i<n;i++){
+            addLevel();
+        }
     };
+
+    // Both run under the level's lock, which keeps the level's mask bit in step with its count
+    void onClaimed(int level, VehicleSize sz) {
+        freeBySize[sz]--;
+        if(levels[level]->freeCount(sz) == 0) levelsWithSpace[sz].clear(level);
+    }
+
+    void onReleased(int level, VehicleSize sz) {
+        freeBySize[sz]++;
+        if(levels[level]->freeCount(sz) == 1) levelsWithSpace[sz].set(level);
+    }
+
+    mutex& lockLevel(int level) {
+        if(level < 0 || level >= levelCount.load()) throw invalid_argument("No such level");
+        return levels[level]->getLock();
+    }
 public:
     static ParkingLot& getInstance(int n) {
         static ParkingLot instance(n);
-        for(int i=0;i<n;i++){
-            instance.levels[i] = new Level();
-        }
         return instance;
     }
 
     void addLevel() {
+        lock_guard<mutex> guard(addLevelMtx);
+        int id = levelCount.load();
+        if(id == MAX_LEVELS) throw logic_error("Too many levels");
         auto newLevel = new Level();
-        levels.push_back(newLevel);
+        if(newLevel->getSlotCount() > 1 << LEVEL_SLOT_BITS) throw logic_error("Too many slots on a level");
+        levels[id] = newLevel;
+        tickets[id] = new Ticket[newLevel->getSlotCount()];
+        occupancy[id] = new OccupancyLog();
+        for(int sz=0;sz<SIZE_COUNT;sz++) {
+            int n = newLevel->freeCount((VehicleSize)sz);
+            freeBySize[sz] += n;
+            if(n > 0) levelsWithSpace[sz].set(id);
+        }
+        levelCount.store(id + 1);
+    }
+
+    int getLevelCount() {
+        return levelCount.load();
+    }
+
+    // Occupancy analytics for one level and slot size over [from, to] in epoch seconds,
+    // limited to the last MINUTES_KEPT minutes
+    int peakOccupancy(int level, VehicleSize sz, int64_t from, int64_t to) {
+        lock_guard<mutex> guard(lockLevel(level));
+        return occupancy[level]->peak(sz, from, to);
+    }
+
+    double averageDwell(int level, VehicleSize sz, int64_t from, int64_t to) {
+        lock_guard<mutex> guard(lockLevel(level));
+        return occupancy[level]->averageDwell(sz, from, to);
+    }
+
+    vector<uint64_t> turnoverHistogram(int level, VehicleSize sz, int64_t from, int64_t to) {
+        lock_guard<mutex> guard(lockLevel(level));
+        return occupancy[level]->turnover(sz, from, to);
+    }
+
+    // Free slots a vehicle of this size could take, counting larger slots
+    int availableFor(VehicleSize sz) {
+        int n = 0;
+        for(int s=sz;s<SIZE_COUNT;s++) {
+            n += freeBySize[s];
+        }
+        return n;
     }
 
     // void setStrategy(SlotSelectionStrategy* st){
@@ -197,27 +594,159 @@ public:
         strategy = ps;
     }
 
-    int Park(Vehicle* vh) {
-        for(int i=0;i<levels.size();i++) {
-            int slot = levels[i]->Park(vh);
-            if(slot != -1) {
-                auto ticket = new Ticket(vh, slot, "some time", i);
-                tickets[ticket->getID()] = ticket;
-                return ticket->getID();
+    // Nearest level at or above the gate's own with a slot of the vehicle's size, else one with
+    // a larger slot. Another gate can fill the level between the lookup and taking its lock,
+    // so the search moves on to the next advertised level; each level is tried at most once
+    // per size. Returns an invalid handle when no level takes the vehicle
+    TicketHandle Park(Vehicle* vh, int gate = 0) {
+        return ParkAt(vh, epochSeconds(), gate);
+    }
+
+    double unPark(TicketHandle handle) {
+        return unParkAt(handle, epochSeconds());
+    }
+
+    // Park and unPark at a given epoch time, for replaying gate events
+    TicketHandle ParkAt(Vehicle* vh, int64_t now, int gate = 0) {
+        int count = max(1, levelCount.load());
+        int home = gate % count;
+        for(int s=vh->getSize();s<SIZE_COUNT;s++) {
+            int from = home;
+            for(int tries=0;tries<count;tries++) {
+                int level = levelsWithSpace[s].firstFrom(from);
+                if(level == -1) break;
+                from = (level + 1) % count;
+                int slot;
+                uint32_t generation = 0;
+                {
+                    lock_guard<mutex> guard(levels[level]->getLock());
+                    slot = levels[level]->Park(vh);
+                    if(slot != -1) {
+                        VehicleSize slotSize = levels[level]->getSlotSize(slot);
+                        onClaimed(level, slotSize);
+                        occupancy[level]->recordArrival(slotSize, now);
+                        generation = tickets[level][slot].issue(vh->getSize(), now);
+                    }
+                }
+                if(slot == -1) continue;
+                return TicketHandle{(uint32_t)level << LEVEL_SLOT_BITS | (uint32_t)slot, generation};
             }
         }
-        return -1;
+        return TicketHandle{0, 0};
     }
 
-    double unPark(int ticketID) {
-        auto ticket = tickets[ticketID];
-        levels[ticket->getLevel()]->unPark(ticket->getSlot());
-        double cost = strategy->getCost(ticket->getSize(), ticket->getEntryTime(), "exit time");
-        ticket->exitVehicle("exit time", cost);
+    double unParkAt(TicketHandle handle, int64_t now) {
+        int level = handle.getLevel(), slot = handle.getSlot();
+        if(!handle.valid() || level >= levelCount.load() || slot >= levels[level]->getSlotCount()) throw invalid_argument("Unknown ticket");
+        lock_guard<mutex> guard(levels[level]->getLock());
+        Ticket& ticket = tickets[level][slot];
+        if(!ticket.isActive(handle.generation)) throw invalid_argument("Unknown or already paid ticket");
+        levels[level]->unPark(slot);
+        VehicleSize slotSize = levels[level]->getSlotSize(slot);
+        onReleased(level, slotSize);
+        occupancy[level]->recordDeparture(slotSize, now, now - ticket.getEntryTime());
+        double cost = strategy->getCost(ticket.getSize(), ticket.getEntryTime(), now);
+        ticket.exitVehicle(now, cost);
         return cost;
-    } 
+    }
 };
 
-int main() {
+uint64_t nowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Multi-gate load for --bench: each gate thread parks a random mix of bikes, cars and trucks
+// and pays its oldest ticket once it holds its share of BENCH_FILL of the lot. The run is
+// repeated for 1, 2, 4, ... gates so the scaling is visible in one go.
+const double BENCH_FILL = 0.8;
+const uint64_t BENCH_SEED = 42;
+
+void runGate(ParkingLot& lot, int gate, int ops, size_t target, uint64_t seed) {
+    Vehicle* vehicles[SIZE_COUNT] = {new Bike("B-" + to_string(gate)), new Car("C-" + to_string(gate)), new Truck("T-" + to_string(gate))};
+    mt19937_64 rng(seed + gate);
+    deque<TicketHandle> held;
+    for(int i=0;i<ops;i++) {
+        if(held.size() < target) {
+            TicketHandle ticket = lot.Park(vehicles[rng() % SIZE_COUNT], gate);
+            if(ticket.valid()) {
+                held.push_back(ticket);
+                continue;
+            }
+        }
+        if(held.empty()) continue;
+        lot.unPark(held.front());
+        held.pop_front();
+    }
+    for(auto t:held) {
+        lot.unPark(t);
+    }
+}
+
+int runBenchmark(int maxGates, int levelCount, int ops) {
+    if(maxGates <= 0 || levelCount <= 0 || ops <= 0) throw invalid_argument("Counts must be positive");
+    if(levelCount > MAX_LEVELS) throw invalid_argument("Too many levels");
+    auto& lot = ParkingLot::getInstance(levelCount);
+    lot.setPricingStrategy(new FixedPricingStrategy(10, 20, 40));
+    Level probe;
+    int capacity = 0;
+    for(int sz=0;sz<SIZE_COUNT;sz++) {
+        capacity += probe.freeCount((VehicleSize)sz) * levelCount;
+    }
+    cout<<"Levels: "<<levelCount<<", capacity: "<<capacity<<", fill: "<<BENCH_FILL<<", ops: "<<ops<<"\n";
+    for(int gates=1;;gates=min(gates * 2, maxGates)) {
+        size_t target = max(1, (int)(capacity * BENCH_FILL / gates));
+        vector<thread> threads;
+        uint64_t start = nowNanos();
+        for(int g=0;g<gates;g++) {
+            threads.emplace_back(runGate, ref(lot), g, ops / gates, target, BENCH_SEED);
+        }
+        for(auto& t:threads) {
+            t.join();
+        }
+        double secs = (nowNanos() - start) / 1e9;
+        cout<<"Gates: "<<gates<<", "<<(uint64_t)(ops / secs)<<" park/unpark ops/s\n";
+        if(gates == maxGates) break;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    // --bench [gates] [levels] [ops]
+    if(argc > 1 && string(argv[1]) == "--bench") {
+        return runBenchmark(argc > 2 ? stoi(argv[2]) : max(1u, thread::hardware_concurrency()),
+                            argc > 3 ? stoi(argv[3]) : 16, argc > 4 ? stoi(argv[4]) : 2000000);
+    }
+
+    auto& lot = ParkingLot::getInstance(2);
+    lot.setPricingStrategy(new FixedPricingStrategy(10, 20, 40));
 
+    vector<TicketHandle> tickets;
+    tickets.push_back(lot.Park(new Car("KA-01-1234")));
+    tickets.push_back(lot.Park(new Bike("KA-02-5678")));
+    tickets.push_back(lot.Park(new Truck("KA-03-9012")));
+    for(auto t:tickets) {
+        cout<<"Ticket "<<t<<"\n";
+    }
+    cout<<"Paid "<<lot.unPark(tickets[0])<<"\n";
+    cout<<"Ticket "<<lot.Park(new Car("KA-04-3456"))<<"\n";
+
+    // Replay a rush of cars over the next hour and ask the occupancy log about level 0
+    int64_t start = epochSeconds();
+    vector<TicketHandle> rush;
+    for(int i=0;i<40;i++) {
+        rush.push_back(lot.ParkAt(new Car("KA-05-" + to_string(1000 + i)), start + i * 30));
+    }
+    for(int i=0;i<40;i++) {
+        lot.unParkAt(rush[i], start + 1200 + i * 90);
+    }
+    int64_t from = start - 3600, to = start + 7200;
+    cout<<"Peak medium occupancy on level 0: "<<lot.peakOccupancy(0, VehicleSize::MEDIUM, from, to)<<"\n";
+    cout<<"Average medium stay on level 0: "<<lot.averageDwell(0, VehicleSize::MEDIUM, from, to)<<"s\n";
+    cout<<"Medium stays on level 0 by length:";
+    auto histogram = lot.turnoverHistogram(0, VehicleSize::MEDIUM, from, to);
+    for(int i=0;i<DWELL_BUCKETS;i++) {
+        if(i < DWELL_BUCKETS - 1) cout<<" <"<<DWELL_LIMITS[i]<<"m: "<<histogram[i];
+        else cout<<" longer: "<<histogram[i];
+    }
+    cout<<"\n";
 }
\ No newline at end of file
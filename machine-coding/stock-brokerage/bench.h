@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Shared by the --bench modes of the brokerage programs
+
+// Log-linear histogram in the style of HdrHistogram: every power of two is split into 64
+// linear sub-buckets, so any value is recorded with under 2% relative error in fixed memory.
+// Not thread-safe; each stage is recorded by a single thread.
+class LatencyHistogram {
+    static constexpr int SUB_BITS = 6;
+    static constexpr uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t maxValue;
+    long double sum;
+
+    static size_t bucketOf(uint64_t v) {
+        if(v < SUB_BUCKETS) return v;
+        int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((v >> shift) - SUB_BUCKETS);
+    }
+
+    static uint64_t highestValueIn(size_t bucket) {
+        if(bucket < SUB_BUCKETS) return bucket;
+        int shift = bucket / SUB_BUCKETS - 1;
+        uint64_t sub = bucket % SUB_BUCKETS + SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram(): counts((64 - SUB_BITS + 1) * SUB_BUCKETS, 0), total(0), maxValue(0), sum(0) {}
+
+    void record(uint64_t nanos) {
+        counts[bucketOf(nanos)]++;
+        total++;
+        sum += nanos;
+        maxValue = std::max(maxValue, nanos);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for(size_t b=0;b<counts.size();b++) {
+            counts[b] += other.counts[b];
+        }
+        total += other.total;
+        sum += other.sum;
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    uint64_t getCount() {
+        return total;
+    }
+
+    uint64_t percentile(double p) {
+        if(total == 0) return 0;
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(p / 100.0 * total));
+        uint64_t seen = 0;
+        for(size_t b=0;b<counts.size();b++) {
+            seen += counts[b];
+            if(seen >= target) return std::min(highestValueIn(b), maxValue);
+        }
+        return maxValue;
+    }
+
+    void print(const std::string& stage) {
+        std::cout<<stage<<": count="<<total<<" mean="<<(total ? (uint64_t)(sum / total) : 0)<<"ns p50="<<percentile(50)<<"ns p90="<<percentile(90)
+            <<"ns p99="<<percentile(99)<<"ns p99.9="<<percentile(99.9)<<"ns max="<<maxValue<<"ns\n";
+    }
+};
+
+// Passes every key=value argument after "--bench" to set(key, value), which returns false
+// for a key it does not know
+template<typename Fn>
+void parseBenchOptions(int argc, char** argv, Fn set) {
+    for(int i=2;i<argc;i++) {
+        std::string arg(argv[i]);
+        auto eq = arg.find('=');
+        if(eq == std::string::npos) throw std::invalid_argument("Expected key=value, got " + arg);
+        std::string key = arg.substr(0, eq);
+        if(!set(key, arg.substr(eq + 1))) throw std::invalid_argument("Unknown benchmark option " + key);
+    }
+}
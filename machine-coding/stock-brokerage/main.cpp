@@ -1,173 +1,2287 @@
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <stdexcept>
 #include <iostream>
 #include <unordered_map>
-#include <queue>
+#include <vector>
+#include <algorithm>
 #include <map>
+#include <set>
+#include <random>
 #include <thread>
 #include <csignal>
+#include <cstdint>
+#include <cmath>
+#include <memory>
+#include <tuple>
+#include <deque>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+#include "bench.h"
 
 using namespace std;
 
 atomic<bool> running{true};
 
+// Prices are integer ticks of the instrument and money is fixed-point minor units (cents),
+// so equal prices always compare equal and the book can index levels by tick.
+using Ticks = int64_t;
+using Cash = int64_t;
+using Qty = int64_t;
+const Cash CASH_SCALE = 100;
+
+Cash toCash(double amt) {
+    return llround(amt * CASH_SCALE);
+}
+
+uint64_t nowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+enum OrderType {
+    Buy,
+    Sell
+};
+
+const int MAX_INSTRUMENTS = 1024;
+
+struct RiskLimits {
+    Cash maxOrderNotional;
+    Cash maxOpenNotional;
+    uint32_t maxOrdersPerSecond;
+};
+
+const RiskLimits DEFAULT_LIMITS{INT64_MAX, INT64_MAX, UINT32_MAX};
+
+// All risk state is plain atomics updated with CAS, so order entry threads, matching shards
+// and concurrent deposits never take a lock. buyingPower is the cash not yet reserved by open
+// buy orders and sellable the shares not yet reserved by open sells: reserving is a single CAS
+// on them, and fills or cancels hand back whatever the order no longer needs.
 class Account {
     static int id;
     int accountId;
-    atomic<double> balance;
+    atomic<Cash> balance;
+    atomic<Cash> buyingPower;
+    atomic<Cash> openNotional;
+    // (second << 32) | orders accepted in that second
+    atomic<uint64_t> rateWindow;
+    unique_ptr<atomic<Qty>[]> positions;
+    unique_ptr<atomic<Qty>[]> sellable;
+    RiskLimits limits;
+
+    static bool tryTake(atomic<int64_t>& value, int64_t amt) {
+        int64_t current = value.load(memory_order_relaxed);
+        do {
+            if(current < amt) return false;
+        } while(!value.compare_exchange_weak(current, current - amt, memory_order_acq_rel, memory_order_relaxed));
+        return true;
+    }
+
+    static bool tryAddCapped(atomic<int64_t>& value, int64_t amt, int64_t cap) {
+        int64_t current = value.load(memory_order_relaxed);
+        do {
+            if(current > cap - amt) return false;
+        } while(!value.compare_exchange_weak(current, current + amt, memory_order_acq_rel, memory_order_relaxed));
+        return true;
+    }
+
+public:
+    Account(RiskLimits l = DEFAULT_LIMITS): accountId(id++), balance(0), buyingPower(0), openNotional(0), rateWindow(0),
+        positions(new atomic<Qty>[MAX_INSTRUMENTS]), sellable(new atomic<Qty>[MAX_INSTRUMENTS]), limits(l) {
+        for(int i=0;i<MAX_INSTRUMENTS;i++) {
+            positions[i].store(0, memory_order_relaxed);
+            sellable[i].store(0, memory_order_relaxed);
+        }
+    }
+
+    int getId() {
+        return accountId;
+    }
+
+    void setLimits(RiskLimits l) {
+        limits = l;
+    }
+
+    void depositMoney(Cash amt) {
+        balance.fetch_add(amt);
+        buyingPower.fetch_add(amt);
+    }
+
+    void debitAmount(Cash amt) {
+        if(!tryTake(buyingPower, amt)) {
+            throw logic_error("Insufficient balance");
+        }
+        balance.fetch_sub(amt);
+    }
+
+    void depositShares(int instrument, Qty qty) {
+        positions[instrument].fetch_add(qty);
+        sellable[instrument].fetch_add(qty);
+    }
+
+    Cash getBalance() {
+        return balance.load();
+    }
+
+    Cash getBuyingPower() {
+        return buyingPower.load();
+    }
+
+    Qty getPosition(int instrument) {
+        return positions[instrument].load();
+    }
+
+    bool admitOrder() {
+        uint64_t now = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        uint64_t current = rateWindow.load(memory_order_relaxed);
+        uint64_t next;
+        do {
+            uint64_t count = (current >> 32) == now ? (current & 0xffffffffULL) : 0;
+            if(count >= limits.maxOrdersPerSecond) return false;
+            next = (now << 32) | (count + 1);
+        } while(!rateWindow.compare_exchange_weak(current, next, memory_order_relaxed));
+        return true;
+    }
+
+    // unitPrice is the limit price of one share in cash
+    bool reserve(OrderType side, int instrument, Qty qty, Cash unitPrice) {
+        Cash notional;
+        if(__builtin_mul_overflow(qty, unitPrice, &notional)) return false;
+        if(notional > limits.maxOrderNotional) return false;
+        if(!tryAddCapped(openNotional, notional, limits.maxOpenNotional)) return false;
+        bool reserved = side == OrderType::Buy ? tryTake(buyingPower, notional) : tryTake(sellable[instrument], qty);
+        if(!reserved) openNotional.fetch_sub(notional);
+        return reserved;
+    }
+
+    // Journal replay re-applies reservations that were already checked when first accepted
+    void forceReserve(OrderType side, int instrument, Qty qty, Cash unitPrice) {
+        openNotional.fetch_add(qty * unitPrice);
+        if(side == OrderType::Buy) buyingPower.fetch_sub(qty * unitPrice);
+        else sellable[instrument].fetch_sub(qty);
+    }
+
+    // Moves an open order's reservation from (oldQty, oldUnit) to (newQty, newUnit), taking
+    // only the increase so funds freed by the old terms are never visible to other orders
+    bool adjustReservation(OrderType side, int instrument, Qty oldQty, Cash oldUnit, Qty newQty, Cash newUnit, bool force) {
+        Cash newNotional;
+        if(__builtin_mul_overflow(newQty, newUnit, &newNotional)) return false;
+        Cash notionalDelta = newNotional - oldQty * oldUnit;
+        if(notionalDelta > 0 && !force) {
+            if(newNotional > limits.maxOrderNotional) return false;
+            if(!tryAddCapped(openNotional, notionalDelta, limits.maxOpenNotional)) return false;
+        } else {
+            openNotional.fetch_add(notionalDelta);
+        }
+        int64_t delta = side == OrderType::Buy ? notionalDelta : newQty - oldQty;
+        auto& available = side == OrderType::Buy ? buyingPower : sellable[instrument];
+        if(delta > 0 && !force) {
+            if(!tryTake(available, delta)) {
+                openNotional.fetch_sub(notionalDelta);
+                return false;
+            }
+        } else {
+            available.fetch_sub(delta);
+        }
+        return true;
+    }
+
+    void release(OrderType side, int instrument, Qty qty, Cash unitPrice) {
+        openNotional.fetch_sub(qty * unitPrice);
+        if(side == OrderType::Buy) buyingPower.fetch_add(qty * unitPrice);
+        else sellable[instrument].fetch_add(qty);
+    }
+
+    void settleFill(OrderType side, int instrument, Qty qty, Cash limitPrice, Cash tradePrice) {
+        openNotional.fetch_sub(qty * limitPrice);
+        if(side == OrderType::Buy) {
+            balance.fetch_sub(qty * tradePrice);
+            buyingPower.fetch_add(qty * (limitPrice - tradePrice));
+            positions[instrument].fetch_add(qty);
+            sellable[instrument].fetch_add(qty);
+        } else {
+            balance.fetch_add(qty * tradePrice);
+            buyingPower.fetch_add(qty * tradePrice);
+            positions[instrument].fetch_sub(qty);
+        }
+    }
+
+    // Net effect of fills restored from a snapshot, on both settled and available amounts
+    void applySettlement(int instrument, Cash cash, Qty shares) {
+        balance.fetch_add(cash);
+        buyingPower.fetch_add(cash);
+        positions[instrument].fetch_add(shares);
+        sellable[instrument].fetch_add(shares);
+    }
+};
+int Account::id = 1;
+
+// Dense id -> account table, readable without locks from every shard
+class AccountRegistry {
+    static constexpr int MAX_ACCOUNTS = 1 << 16;
+    unique_ptr<atomic<Account*>[]> accounts;
+
+    AccountRegistry(): accounts(new atomic<Account*>[MAX_ACCOUNTS]) {
+        for(int i=0;i<MAX_ACCOUNTS;i++) {
+            accounts[i].store(nullptr, memory_order_relaxed);
+        }
+    }
+public:
+    static AccountRegistry& getInstance() {
+        static AccountRegistry instance;
+        return instance;
+    }
+
+    void add(Account* acc) {
+        if(acc->getId() >= MAX_ACCOUNTS) throw length_error("Too many accounts");
+        accounts[acc->getId()].store(acc, memory_order_release);
+    }
+
+    Account* get(int accountId) {
+        if(accountId <= 0 || accountId >= MAX_ACCOUNTS) return nullptr;
+        return accounts[accountId].load(memory_order_acquire);
+    }
+};
+
+// Interns tickers into dense instrument ids (0, 1, ...) that index books, positions and the
+// exchange's shard routes, so nothing past order entry hashes or copies a ticker string.
+// Registration takes a lock; resolving an id back to its ticker does not.
+class InstrumentRegistry {
+    mutex mtx;
+    unordered_map<string, int> ids;
+    unique_ptr<string[]> tickers;
+    atomic<int> count;
+
+    InstrumentRegistry(): tickers(new string[MAX_INSTRUMENTS]), count(0) {}
+public:
+    static InstrumentRegistry& getInstance() {
+        static InstrumentRegistry instance;
+        return instance;
+    }
+
+    int intern(const string& ticker) {
+        lock_guard<mutex> lock(mtx);
+        auto it = ids.find(ticker);
+        if(it != ids.end()) return it->second;
+        int id = count.load(memory_order_relaxed);
+        if(id >= MAX_INSTRUMENTS) throw length_error("Too many stocks");
+        tickers[id] = ticker;
+        ids[ticker] = id;
+        count.store(id + 1, memory_order_release);
+        return id;
+    }
+
+    // -1 if the ticker was never registered
+    int find(const string& ticker) {
+        lock_guard<mutex> lock(mtx);
+        auto it = ids.find(ticker);
+        return it == ids.end() ? -1 : it->second;
+    }
+
+    const string& getTicker(int id) {
+        static const string unknown = "?";
+        if(id < 0 || id >= count.load(memory_order_acquire)) return unknown;
+        return tickers[id];
+    }
+};
+
+class Stock {
+    string ticker;
+    Cash tickSize;
+    Ticks price;
+    int index;
+public:
+    Stock(string tkr, Ticks p, Cash tick = 1): ticker(tkr), tickSize(tick), price(p), index(-1) {
+        if(tickSize <= 0) throw invalid_argument("Tick size must be positive");
+    }
+
+    Ticks toTicks(double p) {
+        return llround(p * CASH_SCALE / tickSize);
+    }
+
+    Cash toCash(Ticks t) {
+        return t * tickSize;
+    }
+
+    void updatePrice(Ticks p) {
+        price = p;
+    }
+
+    Ticks getPrice() {
+        return price;
+    }
+
+    Cash getTickSize() {
+        return tickSize;
+    }
+
+    string getTicker() {
+        return ticker;
+    }
+
+    int getIndex() {
+        return index;
+    }
+
+    void setIndex(int i) {
+        index = i;
+    }
+};
+
+enum OrderStatus {
+    Pending,
+    Completed,
+    Rejected,
+    Cancelled
+};
+
+enum TimeInForce {
+    GoodTillCancel,
+    // Trades what it can on arrival and cancels the rest
+    ImmediateOrCancel,
+    // Trades in full on arrival or not at all
+    FillOrKill
+};
+
+enum RequestType {
+    NewOrder,
+    CancelOrder,
+    ReplaceOrder,
+    ReduceOrder,
+    // Per-ticker call auction: orders rest without crossing until the ticker is uncrossed
+    OpenAuction,
+    Uncross
+};
+
+// Fixed-size inbound message, copied by value through the shard rings so the order entry
+// path never allocates. The matching shard materialises it into a pooled IOrder.
+struct OrderRequest {
+    RequestType type;
+    int orderId;
+    OrderType orderType;
+    int accountId;
+    int instrument;
+    Cash tickSize;
+    Qty quantity;
+    Ticks price;
+    TimeInForce timeInForce;
+    // Iceberg: quantity is the displayed slice, hiddenQuantity the reserve behind it and
+    // displayQuantity the slice size each refill shows; 0 for a plain order
+    Qty displayQuantity;
+    Qty hiddenQuantity;
+    uint64_t entryTime;
+    // Batch entry: new orders rest without matching until the request marked batchEnd
+    bool deferMatch;
+    bool batchEnd;
+};
+
+class IOrder {
+public:
+    static atomic<int> nextId;
+    int orderId;
+    Qty quantity;
+    Ticks price;
+    OrderStatus status;
+    OrderType orderType;
+    int accountId;
+    int instrument;
+    Cash tickSize;
+    Qty displayQuantity;
+    Qty hiddenQuantity;
+    // When the order last joined the back of its level, refills included; orders are
+    // snapshotted in this order so recovery rebuilds each level's FIFO
+    uint64_t arrival;
+    // When the order was placed or replaced; an iceberg refill keeps it, so a refilled slice
+    // stays the resting side and of two crossing orders the later one is the aggressor
+    uint64_t entered;
+    // Intrusive links into the FIFO of the price level the order rests on
+    IOrder* prev;
+    IOrder* next;
+    IOrder(): orderId(0), quantity(0), price(0), status(Pending), orderType(Buy), accountId(0), instrument(0), tickSize(1),
+        displayQuantity(0), hiddenQuantity(0), arrival(0), entered(0), prev(nullptr), next(nullptr) {}
+
+    // Displayed plus hidden quantity still open
+    Qty leaves() {
+        return quantity + hiddenQuantity;
+    }
+
+    void reset(const OrderRequest& req) {
+        orderId = req.orderId;
+        quantity = req.quantity;
+        price = req.price;
+        status = Pending;
+        orderType = req.orderType;
+        accountId = req.accountId;
+        instrument = req.instrument;
+        tickSize = req.tickSize;
+        displayQuantity = req.displayQuantity;
+        hiddenQuantity = req.hiddenQuantity;
+        arrival = 0;
+        entered = 0;
+        prev = next = nullptr;
+    }
+};
+atomic<int> IOrder::nextId{1};
+
+// Slab allocator for the orders of one shard. Slabs are never returned to the heap: filled
+// and cancelled orders go back on an intrusive free list, so a warmed-up shard serves every
+// new order without calling malloc. Counters are written by the shard thread only and can
+// be scraped from any thread.
+class OrderPool {
+    static constexpr size_t SLAB_SIZE = 4096;
+
+    vector<unique_ptr<IOrder[]>> slabs;
+    IOrder* freeList;
+    atomic<uint64_t> slabCount;
+    atomic<uint64_t> allocations;
+    atomic<uint64_t> recycled;
+    atomic<uint64_t> inUse;
+
+    void addSlab() {
+        slabs.emplace_back(new IOrder[SLAB_SIZE]);
+        IOrder* slab = slabs.back().get();
+        for(size_t i=0;i<SLAB_SIZE;i++) {
+            slab[i].next = freeList;
+            freeList = &slab[i];
+        }
+        slabCount.fetch_add(1, memory_order_relaxed);
+    }
+
+public:
+    struct Stats {
+        uint64_t slabs;
+        uint64_t capacity;
+        uint64_t allocations;
+        uint64_t recycled;
+        uint64_t inUse;
+    };
+
+    OrderPool(size_t initialOrders = SLAB_SIZE): freeList(nullptr), slabCount(0), allocations(0), recycled(0), inUse(0) {
+        slabs.reserve(64);
+        for(size_t n=0;n<initialOrders;n+=SLAB_SIZE) {
+            addSlab();
+        }
+    }
+
+    IOrder* acquire(const OrderRequest& req) {
+        if(freeList == nullptr) addSlab();
+        IOrder* order = freeList;
+        freeList = order->next;
+        order->reset(req);
+        allocations.fetch_add(1, memory_order_relaxed);
+        inUse.fetch_add(1, memory_order_relaxed);
+        return order;
+    }
+
+    void release(IOrder* order) {
+        order->prev = nullptr;
+        order->next = freeList;
+        freeList = order;
+        recycled.fetch_add(1, memory_order_relaxed);
+        inUse.fetch_sub(1, memory_order_relaxed);
+    }
+
+    Stats getStats() {
+        uint64_t s = slabCount.load(memory_order_relaxed);
+        return {s, s * SLAB_SIZE, allocations.load(memory_order_relaxed), recycled.load(memory_order_relaxed), inUse.load(memory_order_relaxed)};
+    }
+};
+
+const size_t CACHE_LINE = 64;
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    this_thread::yield();
+#endif
+}
+
+enum WaitStrategy {
+    BusySpin,
+    SpinThenPark,
+    Blocking
+};
+
+// Bounded lock-free multi-producer/single-consumer ring. Every slot carries a sequence
+// number: producers claim a position with a CAS on head and publish by bumping the slot's
+// sequence, the consumer reads slots in order without touching shared counters.
+template<typename T>
+class RingBuffer {
+    struct alignas(CACHE_LINE) Slot {
+        atomic<uint64_t> sequence;
+        T value;
+    };
+
+    static constexpr int SPIN_LIMIT = 4096;
+
+    const uint64_t capacity;
+    const uint64_t mask;
+    const WaitStrategy strategy;
+    unique_ptr<Slot[]> slots;
+    alignas(CACHE_LINE) atomic<uint64_t> head;
+    alignas(CACHE_LINE) uint64_t tail;
+    alignas(CACHE_LINE) atomic<bool> parked;
+    mutex mtx;
+    condition_variable cond;
+
+    bool readable() {
+        return slots[tail & mask].sequence.load(memory_order_acquire) == tail + 1;
+    }
+
+    void wakeConsumer() {
+        atomic_thread_fence(memory_order_seq_cst);
+        if(parked.load(memory_order_relaxed)) {
+            lock_guard<mutex> lock(mtx);
+            cond.notify_one();
+        }
+    }
+
+    void park() {
+        unique_lock<mutex> lock(mtx);
+        parked.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        // The timeout only bounds how long a shutdown request can go unnoticed
+        if(!readable()) cond.wait_for(lock, chrono::milliseconds(100));
+        parked.store(false, memory_order_relaxed);
+    }
+
+public:
+    RingBuffer(size_t cap, WaitStrategy ws = WaitStrategy::SpinThenPark): capacity(cap), mask(cap - 1), strategy(ws),
+        slots(new Slot[cap]), head(0), tail(0), parked(false) {
+        if(cap == 0 || (cap & (cap - 1)) != 0) throw invalid_argument("Ring capacity must be a power of two");
+        for(uint64_t i=0;i<capacity;i++) {
+            slots[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    bool tryPush(const T& value) {
+        uint64_t pos = head.load(memory_order_relaxed);
+        while(true) {
+            auto& slot = slots[pos & mask];
+            int64_t diff = (int64_t)slot.sequence.load(memory_order_acquire) - (int64_t)pos;
+            if(diff == 0) {
+                if(head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    slot.value = value;
+                    slot.sequence.store(pos + 1, memory_order_release);
+                    if(strategy != WaitStrategy::BusySpin) wakeConsumer();
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = head.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Spins while the ring is full; producers are back-pressured rather than dropped
+    void push(const T& value) {
+        while(!tryPush(value)) {
+            cpuRelax();
+        }
+    }
+
+    // Claims n consecutive slots with a single CAS. The consumer frees slots in order, so if
+    // the last slot of the range is free for this lap, every slot before it is too.
+    bool tryPushBatch(const T* values, size_t n) {
+        if(n == 0) return true;
+        if(n > capacity) return false;
+        uint64_t pos = head.load(memory_order_relaxed);
+        while(true) {
+            uint64_t last = pos + n - 1;
+            int64_t diff = (int64_t)slots[last & mask].sequence.load(memory_order_acquire) - (int64_t)last;
+            if(diff == 0) {
+                if(head.compare_exchange_weak(pos, pos + n, memory_order_relaxed)) {
+                    for(size_t i=0;i<n;i++) {
+                        auto& slot = slots[(pos + i) & mask];
+                        slot.value = values[i];
+                        slot.sequence.store(pos + i + 1, memory_order_release);
+                    }
+                    if(strategy != WaitStrategy::BusySpin) wakeConsumer();
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = head.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    void pushBatch(const T* values, size_t n) {
+        while(!tryPushBatch(values, n)) {
+            cpuRelax();
+        }
+    }
+
+    size_t getCapacity() {
+        return capacity;
+    }
+
+    size_t tryPopBatch(T* out, size_t maxItems) {
+        size_t n = 0;
+        while(n < maxItems && readable()) {
+            auto& slot = slots[tail & mask];
+            out[n++] = slot.value;
+            slot.sequence.store(tail + capacity, memory_order_release);
+            tail++;
+        }
+        return n;
+    }
+
+    // Waits for at least one item according to the wait strategy, or until keepRunning is cleared
+    size_t popBatch(T* out, size_t maxItems, atomic<bool>& keepRunning) {
+        int spins = 0;
+        while(keepRunning) {
+            size_t n = tryPopBatch(out, maxItems);
+            if(n > 0) return n;
+            if(strategy == WaitStrategy::BusySpin || (strategy == WaitStrategy::SpinThenPark && spins++ < SPIN_LIMIT)) {
+                cpuRelax();
+            } else {
+                park();
+            }
+        }
+        return 0;
+    }
+
+    bool empty() {
+        return !readable();
+    }
+};
+
+using OrderQueue = RingBuffer<OrderRequest>;
+
+enum ReportType {
+    OrderAck,
+    OrderFill,
+    OrderReject,
+    OrderCancelled,
+    OrderReplaced,
+    OrderReduced
+};
+
+// Binary execution report. Sequence numbers are per shard, so a consumer can detect gaps
+// in each shard's stream independently.
+struct ExecutionReport {
+    uint64_t sequence;
+    int shardId;
+    ReportType type;
+    int orderId;
+    int counterOrderId;
+    OrderType side;
+    Qty quantity;
+    Ticks price;
+    Qty leavesQuantity;
+    uint64_t transactTime;
+    int instrument;
+};
+
+using ReportQueue = RingBuffer<ExecutionReport>;
+
+// New aggregate quantity resting at one price level (0 once the level is empty)
+struct BookUpdate {
+    uint64_t sequence;
+    int shardId;
+    OrderType side;
+    Ticks price;
+    Qty quantity;
+    int instrument;
+};
+
+using MarketDataQueue = RingBuffer<BookUpdate>;
+
+struct PriceLevel {
+    Qty totalQuantity;
+    // Iceberg reserve resting behind the displayed quantity; not published
+    Qty hiddenQuantity;
+    IOrder* head;
+    IOrder* tail;
+    PriceLevel(): totalQuantity(0), hiddenQuantity(0), head(nullptr), tail(nullptr) {}
+
+    bool empty() {
+        return head == nullptr;
+    }
+
+    void push(IOrder* order) {
+        order->prev = tail;
+        order->next = nullptr;
+        if(tail) tail->next = order;
+        else head = order;
+        tail = order;
+        totalQuantity += order->quantity;
+        hiddenQuantity += order->hiddenQuantity;
+    }
+
+    void remove(IOrder* order) {
+        if(order->prev) order->prev->next = order->next;
+        else head = order->next;
+        if(order->next) order->next->prev = order->prev;
+        else tail = order->prev;
+        order->prev = order->next = nullptr;
+        totalQuantity -= order->quantity;
+        hiddenQuantity -= order->hiddenQuantity;
+    }
+};
+
+// Levels live in tick-indexed arrays covering [baseTick, baseTick + size), so finding the
+// level for a price is a single index. The window is centred on the first order and grows
+// when a price falls outside it, up to MAX_WINDOW_LEVELS; levels beyond that go to sparse
+// maps, so an outlier price costs one map node instead of a huge array and a long scan.
+class OrderBook {
+    static constexpr Ticks INITIAL_LEVELS = 1024;
+    static constexpr Ticks MAX_WINDOW_LEVELS = 1 << 14;
+    static constexpr Ticks NO_BID = INT64_MIN;
+    static constexpr Ticks NO_ASK = INT64_MAX;
+
+    Ticks baseTick;
+    vector<PriceLevel> bids;
+    vector<PriceLevel> asks;
+    // Non-empty levels outside the window
+    map<Ticks, PriceLevel> farBids;
+    map<Ticks, PriceLevel> farAsks;
+    Ticks bestBidTick;
+    Ticks bestAskTick;
+    bool auction;
+    uint64_t arrivals;
+
+    bool inWindow(Ticks price) {
+        return price >= baseTick && price < baseTick + (Ticks)bids.size();
+    }
+
+    void ensureCovered(Ticks price) {
+        Ticks size = bids.size();
+        if(size == 0) {
+            baseTick = max<Ticks>(1, price - INITIAL_LEVELS / 2);
+            bids.resize(INITIAL_LEVELS);
+            asks.resize(INITIAL_LEVELS);
+            return;
+        }
+        if(inWindow(price)) return;
+
+        Ticks low = min(baseTick, max<Ticks>(1, price - size / 2));
+        Ticks high = max(baseTick + size, price + size / 2);
+        Ticks newSize = min(MAX_WINDOW_LEVELS, max(high - low, 2 * size));
+        // Grow downwards keeping the top, or upwards keeping the base
+        low = price < baseTick ? max<Ticks>(1, baseTick + size - newSize) : baseTick;
+        if(price < low || price >= low + newSize) return;
+        Ticks shift = baseTick - low;
+        vector<PriceLevel> newBids(newSize), newAsks(newSize);
+        copy(bids.begin(), bids.end(), newBids.begin() + shift);
+        copy(asks.begin(), asks.end(), newAsks.begin() + shift);
+        bids.swap(newBids);
+        asks.swap(newAsks);
+        baseTick = low;
+        // Far levels the window now covers move into it
+        for(auto far:{make_pair(&farBids, &bids), make_pair(&farAsks, &asks)}) {
+            auto it = far.first->lower_bound(low);
+            while(it != far.first->end() && it->first < low + newSize) {
+                (*far.second)[it->first - low] = it->second;
+                it = far.first->erase(it);
+            }
+        }
+    }
+
+    PriceLevel& level(OrderType side, Ticks price) {
+        if(inWindow(price)) return (side == OrderType::Buy ? bids : asks)[price - baseTick];
+        return (side == OrderType::Buy ? farBids : farAsks)[price];
+    }
+
+    // Existing level for a price, or nullptr; unlike level() it never creates a far entry
+    PriceLevel* findLevel(OrderType side, Ticks price) {
+        if(inWindow(price)) return &level(side, price);
+        auto& far = side == OrderType::Buy ? farBids : farAsks;
+        auto it = far.find(price);
+        return it == far.end() ? nullptr : &it->second;
+    }
+
+    bool emptyAt(OrderType side, Ticks price) {
+        PriceLevel* lvl = findLevel(side, price);
+        return lvl == nullptr || lvl->empty();
+    }
+
+    // Far levels are erased once empty, so the maps only hold live prices
+    void dropIfEmpty(OrderType side, Ticks price) {
+        if(inWindow(price)) return;
+        auto& far = side == OrderType::Buy ? farBids : farAsks;
+        auto it = far.find(price);
+        if(it != far.end() && it->second.empty()) far.erase(it);
+    }
+
+    // Visits the non-empty levels of one side priced in [low, high], best first for that side
+    // (descending bids, ascending asks), until fn returns true
+    template<typename Fn>
+    void visitLevels(OrderType side, Ticks low, Ticks high, Fn fn) {
+        if(low > high) return;
+        bool isBuy = side == OrderType::Buy;
+        auto& dense = isBuy ? bids : asks;
+        auto& far = isBuy ? farBids : farAsks;
+        Ticks top = baseTick + (Ticks)dense.size() - 1;
+        Ticks denseLow = max(low, baseTick), denseHigh = min(high, top);
+        if(isBuy) {
+            for(auto it = far.upper_bound(high); it != far.begin();) {
+                --it;
+                if(it->first < low || it->first < baseTick) break;
+                if(fn(it->first, it->second)) return;
+            }
+            for(Ticks p = denseHigh; p >= denseLow; p--) {
+                if(!dense[p - baseTick].empty() && fn(p, dense[p - baseTick])) return;
+            }
+            for(auto it = far.upper_bound(min(high, baseTick - 1)); it != far.begin();) {
+                --it;
+                if(it->first < low) break;
+                if(fn(it->first, it->second)) return;
+            }
+        } else {
+            for(auto it = far.lower_bound(low); it != far.end() && it->first <= high && it->first < baseTick; ++it) {
+                if(fn(it->first, it->second)) return;
+            }
+            for(Ticks p = denseLow; p <= denseHigh; p++) {
+                if(!dense[p - baseTick].empty() && fn(p, dense[p - baseTick])) return;
+            }
+            for(auto it = far.lower_bound(max(low, top + 1)); it != far.end() && it->first <= high; ++it) {
+                if(fn(it->first, it->second)) return;
+            }
+        }
+    }
+
+    // The old best emptied, so the next best is at or behind it
+    void refreshBestBid() {
+        if(bestBidTick == NO_BID || !emptyAt(OrderType::Buy, bestBidTick)) return;
+        Ticks from = bestBidTick;
+        bestBidTick = NO_BID;
+        visitLevels(OrderType::Buy, 1, from, [this](Ticks p, PriceLevel&) { bestBidTick = p; return true; });
+    }
+
+    void refreshBestAsk() {
+        if(bestAskTick == NO_ASK || !emptyAt(OrderType::Sell, bestAskTick)) return;
+        Ticks from = bestAskTick;
+        bestAskTick = NO_ASK;
+        visitLevels(OrderType::Sell, from, NO_ASK - 1, [this](Ticks p, PriceLevel&) { bestAskTick = p; return true; });
+    }
+
+public:
+    OrderBook(): baseTick(0), bestBidTick(NO_BID), bestAskTick(NO_ASK), auction(false), arrivals(0) {}
+
+    bool inAuction() {
+        return auction;
+    }
+
+    void setAuction(bool a) {
+        auction = a;
+    }
+
+    void addOrder(IOrder* order) {
+        order->entered = arrivals + 1;
+        requeue(order);
+    }
+
+    // Back of its level without counting as a new entry, for iceberg refills
+    void requeue(IOrder* order) {
+        ensureCovered(order->price);
+        order->arrival = ++arrivals;
+        level(order->orderType, order->price).push(order);
+        if(order->orderType == OrderType::Buy) bestBidTick = max(bestBidTick, order->price);
+        else bestAskTick = min(bestAskTick, order->price);
+    }
+
+    Qty levelQuantity(OrderType side, Ticks price) {
+        PriceLevel* lvl = findLevel(side, price);
+        return lvl == nullptr ? 0 : lvl->totalQuantity;
+    }
+
+    template<typename Fn>
+    void forEachLevel(Fn fn) {
+        for(size_t i=0;i<bids.size();i++) {
+            if(!bids[i].empty()) fn(OrderType::Buy, baseTick + (Ticks)i, bids[i].totalQuantity);
+            if(!asks[i].empty()) fn(OrderType::Sell, baseTick + (Ticks)i, asks[i].totalQuantity);
+        }
+        for(auto& it:farBids) fn(OrderType::Buy, it.first, it.second.totalQuantity);
+        for(auto& it:farAsks) fn(OrderType::Sell, it.first, it.second.totalQuantity);
+    }
+
+    bool crossed() {
+        return bestBidTick != NO_BID && bestAskTick != NO_ASK && bestBidTick >= bestAskTick;
+    }
+
+    // Single clearing price for a crossed book: the price with the most executable volume,
+    // ties broken by the smaller buy/sell imbalance, then the lower price. Only levels
+    // inside [best ask, best bid] can trade, so only their prices, and the first price past
+    // each of them, are candidates; between two levels the volumes do not change. Iceberg
+    // reserves count in full, since uncross keeps trading refilled slices at the same price.
+    bool equilibrium(Ticks& price, Qty& volume) {
+        if(!crossed()) return false;
+        // price -> (bid quantity, ask quantity)
+        map<Ticks, pair<Qty, Qty>> depth;
+        // Demand at p is every bid priced at or above p
+        Qty demand = 0;
+        visitLevels(OrderType::Buy, bestAskTick, bestBidTick, [&](Ticks p, PriceLevel& lvl) {
+            depth[p].first += lvl.totalQuantity + lvl.hiddenQuantity;
+            demand += lvl.totalQuantity + lvl.hiddenQuantity;
+            return false;
+        });
+        visitLevels(OrderType::Sell, bestAskTick, bestBidTick, [&](Ticks p, PriceLevel& lvl) {
+            depth[p].second += lvl.totalQuantity + lvl.hiddenQuantity;
+            return false;
+        });
+        Qty supply = 0;
+        Qty imbalance = 0;
+        volume = 0;
+        auto consider = [&](Ticks p) {
+            Qty executable = min(demand, supply);
+            Qty surplus = demand > supply ? demand - supply : supply - demand;
+            if(executable > volume || (executable == volume && surplus < imbalance)) {
+                price = p;
+                volume = executable;
+                imbalance = surplus;
+            }
+        };
+        for(auto it = depth.begin(); it != depth.end(); ++it) {
+            supply += it->second.second;
+            consider(it->first);
+            demand -= it->second.first;
+            auto next = std::next(it);
+            if(next != depth.end() && it->first + 1 < next->first) consider(it->first + 1);
+        }
+        return volume > 0;
+    }
+
+    // FOK liquidity probe: whether qty (displayed and hidden) rests on the opposite side at
+    // or better than limit. Stops at the first level that completes it.
+    bool canFill(OrderType side, Ticks limit, Qty qty) {
+        Qty available = 0;
+        bool filled = false;
+        auto add = [&](Ticks, PriceLevel& lvl) {
+            available += lvl.totalQuantity + lvl.hiddenQuantity;
+            filled = available >= qty;
+            return filled;
+        };
+        if(side == OrderType::Buy) {
+            if(bestAskTick != NO_ASK) visitLevels(OrderType::Sell, bestAskTick, limit, add);
+        } else {
+            if(bestBidTick != NO_BID) visitLevels(OrderType::Buy, limit, bestBidTick, add);
+        }
+        return filled;
+    }
+
+    PriceLevel* bestBid() {
+        return bestBidTick == NO_BID ? nullptr : &level(OrderType::Buy, bestBidTick);
+    }
+
+    PriceLevel* bestAsk() {
+        return bestAskTick == NO_ASK ? nullptr : &level(OrderType::Sell, bestAskTick);
+    }
+
+    // Reduces a resting order, unlinking it from its level once filled
+    void fill(IOrder* order, Qty qty) {
+        auto& lvl = level(order->orderType, order->price);
+        order->quantity -= qty;
+        lvl.totalQuantity -= qty;
+        if(order->quantity == 0) {
+            lvl.remove(order);
+            order->status = Completed;
+            dropIfEmpty(order->orderType, order->price);
+            if(order->orderType == OrderType::Buy) refreshBestBid();
+            else refreshBestAsk();
+        }
+    }
+
+    void reduceHidden(IOrder* order, Qty qty) {
+        order->hiddenQuantity -= qty;
+        level(order->orderType, order->price).hiddenQuantity -= qty;
+    }
+
+    void remove(IOrder* order) {
+        level(order->orderType, order->price).remove(order);
+        dropIfEmpty(order->orderType, order->price);
+        if(order->orderType == OrderType::Buy) refreshBestBid();
+        else refreshBestAsk();
+    }
+
+    // Visits resting orders level by level in FIFO order, so re-adding them in visit order
+    // reproduces time priority
+    template<typename Fn>
+    void forEachOrder(Fn fn) {
+        for(auto side:{&bids, &asks}) {
+            for(auto& lvl:*side) {
+                for(IOrder* o = lvl.head; o != nullptr; o = o->next) {
+                    fn(o);
+                }
+            }
+        }
+        for(auto side:{&farBids, &farAsks}) {
+            for(auto& it:*side) {
+                for(IOrder* o = it.second.head; o != nullptr; o = o->next) {
+                    fn(o);
+                }
+            }
+        }
+    }
+};
+
+// Open-addressing map from order id to resting order (linear probing, backward-shift
+// deletion). Ids start at 1, so 0 marks an empty bucket. Unlike unordered_map it does not
+// allocate per insert, which keeps cancels off the heap.
+class OrderIndex {
+    struct Entry {
+        int orderId;
+        IOrder* order;
+    };
+
+    vector<Entry> table;
+    size_t mask;
+    size_t count;
+
+    size_t bucket(int orderId) {
+        return ((uint64_t)orderId * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+    }
+
+    void grow() {
+        vector<Entry> old;
+        old.swap(table);
+        table.assign(old.size() * 2, {0, nullptr});
+        mask = table.size() - 1;
+        count = 0;
+        for(auto& e:old) {
+            if(e.orderId != 0) insert(e.orderId, e.order);
+        }
+    }
+
+public:
+    OrderIndex(size_t capacity = 1 << 16): table(capacity, {0, nullptr}), mask(capacity - 1), count(0) {}
+
+    void insert(int orderId, IOrder* order) {
+        if((count + 1) * 2 > table.size()) grow();
+        size_t i = bucket(orderId);
+        while(table[i].orderId != 0 && table[i].orderId != orderId) {
+            i = (i + 1) & mask;
+        }
+        if(table[i].orderId == 0) count++;
+        table[i] = {orderId, order};
+    }
+
+    IOrder* find(int orderId) {
+        for(size_t i = bucket(orderId); table[i].orderId != 0; i = (i + 1) & mask) {
+            if(table[i].orderId == orderId) return table[i].order;
+        }
+        return nullptr;
+    }
+
+    void erase(int orderId) {
+        size_t i = bucket(orderId);
+        while(table[i].orderId != orderId) {
+            if(table[i].orderId == 0) return;
+            i = (i + 1) & mask;
+        }
+        // Pull later entries of the probe run back so lookups never need tombstones
+        size_t j = i;
+        while(true) {
+            j = (j + 1) & mask;
+            if(table[j].orderId == 0) break;
+            size_t home = bucket(table[j].orderId);
+            if(((j - home) & mask) >= ((j - i) & mask)) {
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i] = {0, nullptr};
+        count--;
+    }
+};
+
+class MatchingEngine {
+    // Indexed by instrument id
+    vector<OrderBook> books;
+    OrderPool pool;
+    OrderIndex index;
+    int shardId;
+    ReportQueue* reports;
+    uint64_t reportSequence;
+    // Reports that found the report ring full, sent in order ahead of any newer report once
+    // it has room, so a slow consumer delays fills but never loses them
+    deque<ExecutionReport> pendingReports;
+    atomic<uint64_t> deferredReports;
+    bool replaying;
+    MarketDataQueue* marketData;
+    uint64_t bookSequence;
+    // (instrument, side, price) of levels changed by the current request
+    vector<tuple<int, OrderType, Ticks>> touched;
+    // Levels whose update found the market data ring full. Updates carry the level's absolute
+    // quantity, so each is republished once with its quantity at that time when the ring has
+    // room: a slow feed sees the level's changes conflated, never lost.
+    set<tuple<int, OrderType, Ticks>> staleLevels;
+    atomic<uint64_t> conflatedBookUpdates;
+    AccountRegistry* accounts;
+    // Net cash and shares this shard's fills moved per (account, instrument); snapshotted so
+    // balances survive journal truncation
+    unordered_map<uint64_t, pair<Cash, Qty>> settlements;
+    vector<int> pendingSweeps;
+    // Last trade price per instrument (0 before the first trade), read by order entry threads
+    unique_ptr<atomic<Ticks>[]> lastTrade;
+
+    void retire(IOrder* order) {
+        index.erase(order->orderId);
+        pool.release(order);
+    }
+
+    void releaseReservation(IOrder* order, Qty qty) {
+        if(auto acc = accounts->get(order->accountId)) {
+            acc->release(order->orderType, order->instrument, qty, order->price * order->tickSize);
+        }
+    }
+
+    void settle(IOrder* order, Qty qty, Ticks tradePrice) {
+        auto acc = accounts->get(order->accountId);
+        if(acc == nullptr) return;
+        Cash trade = tradePrice * order->tickSize;
+        acc->settleFill(order->orderType, order->instrument, qty, order->price * order->tickSize, trade);
+        auto& net = settlements[((uint64_t)order->accountId << 32) | (uint32_t)order->instrument];
+        bool isBuy = order->orderType == OrderType::Buy;
+        net.first += isBuy ? -qty * trade : qty * trade;
+        net.second += isBuy ? qty : -qty;
+    }
+
+    void touch(IOrder* order) {
+        touched.emplace_back(order->instrument, order->orderType, order->price);
+    }
+
+    // Sequences stay contiguous: a full ring does not use up a sequence number
+    bool pushBookUpdate(int instrument, OrderType side, Ticks price) {
+        BookUpdate u;
+        u.sequence = bookSequence + 1;
+        u.shardId = shardId;
+        u.side = side;
+        u.price = price;
+        u.quantity = books[instrument].levelQuantity(side, price);
+        u.instrument = instrument;
+        if(!marketData->tryPush(u)) return false;
+        bookSequence++;
+        return true;
+    }
+
+    void publishLevel(const tuple<int, OrderType, Ticks>& level) {
+        if(pushBookUpdate(get<0>(level), get<1>(level), get<2>(level))) return;
+        staleLevels.insert(level);
+        conflatedBookUpdates.fetch_add(1, memory_order_relaxed);
+    }
+
+    void flushStaleLevels() {
+        while(!staleLevels.empty()) {
+            auto& level = *staleLevels.begin();
+            if(!pushBookUpdate(get<0>(level), get<1>(level), get<2>(level))) return;
+            staleLevels.erase(staleLevels.begin());
+        }
+    }
+
+    // One update per level touched by a request, however many fills hit that level
+    void publishTouched() {
+        if(marketData == nullptr || replaying) {
+            touched.clear();
+            return;
+        }
+        flushStaleLevels();
+        if(touched.empty()) return;
+        sort(touched.begin(), touched.end());
+        touched.erase(unique(touched.begin(), touched.end()), touched.end());
+        for(auto& t:touched) {
+            publishLevel(t);
+        }
+        touched.clear();
+    }
+
+    void flushPendingReports() {
+        while(!pendingReports.empty() && reports->tryPush(pendingReports.front())) pendingReports.pop_front();
+    }
+
+    // Never waits: a full report ring defers the report instead of stalling matching
+    void emit(ReportType type, int orderId, OrderType side, int instrument, Qty quantity, Ticks price, Qty leaves, int counterOrderId = 0) {
+        // Replay regenerates the same sequence numbers but does not re-publish old reports
+        uint64_t sequence = ++reportSequence;
+        if(reports == nullptr || replaying) return;
+        ExecutionReport r;
+        r.sequence = sequence;
+        r.shardId = shardId;
+        r.type = type;
+        r.orderId = orderId;
+        r.counterOrderId = counterOrderId;
+        r.side = side;
+        r.quantity = quantity;
+        r.price = price;
+        r.leavesQuantity = leaves;
+        r.transactTime = nowNanos();
+        r.instrument = instrument;
+        flushPendingReports();
+        if(pendingReports.empty() && reports->tryPush(r)) return;
+        pendingReports.push_back(r);
+        deferredReports.fetch_add(1, memory_order_relaxed);
+    }
+
+    void emit(ReportType type, IOrder* order, Qty quantity, Ticks price, int counterOrderId = 0) {
+        emit(type, order->orderId, order->orderType, order->instrument, quantity, price, order->leaves(), counterOrderId);
+    }
+
+public:
+    MatchingEngine(int id = 0, ReportQueue* r = nullptr, MarketDataQueue* md = nullptr): books(MAX_INSTRUMENTS), shardId(id), reports(r), reportSequence(0), deferredReports(0),
+        replaying(false), marketData(md), bookSequence(0), conflatedBookUpdates(0), accounts(&AccountRegistry::getInstance()) {
+        touched.reserve(256);
+        pendingSweeps.reserve(64);
+        lastTrade.reset(new atomic<Ticks>[MAX_INSTRUMENTS]);
+        for(int i=0;i<MAX_INSTRUMENTS;i++) {
+            lastTrade[i].store(0, memory_order_relaxed);
+        }
+    }
+
+    Ticks getLastTradePrice(int instrument) {
+        return lastTrade[instrument].load(memory_order_relaxed);
+    }
+
+    void setReplaying(bool r) {
+        replaying = r;
+    }
+
+    uint64_t getReportSequence() {
+        return reportSequence;
+    }
+
+    void setReportSequence(uint64_t seq) {
+        reportSequence = seq;
+    }
+
+    // Puts a snapshotted order straight back on its level, without matching or reporting
+    void restoreOrder(const OrderRequest& req) {
+        IOrder* order = pool.acquire(req);
+        if(auto acc = accounts->get(req.accountId)) {
+            acc->forceReserve(req.orderType, req.instrument, req.quantity + req.hiddenQuantity, req.price * req.tickSize);
+        }
+        index.insert(order->orderId, order);
+        books[order->instrument].addOrder(order);
+    }
+
+    void restoreSettlement(int accountId, int instrument, Cash cash, Qty shares) {
+        if(auto acc = accounts->get(accountId)) acc->applySettlement(instrument, cash, shares);
+        auto& net = settlements[((uint64_t)accountId << 32) | (uint32_t)instrument];
+        net.first += cash;
+        net.second += shares;
+    }
+
+    template<typename Fn>
+    void forEachSettlement(Fn fn) {
+        for(auto& it:settlements) {
+            fn((int)(it.first >> 32), (int)(uint32_t)it.first, it.second.first, it.second.second);
+        }
+    }
+
+    template<typename Fn>
+    void forEachAuction(Fn fn) {
+        for(int i=0;i<(int)books.size();i++) {
+            if(books[i].inAuction()) fn(i);
+        }
+    }
+
+    // Snapshotted auction phase; nothing crosses until the instrument is uncrossed
+    void restoreAuction(int instrument) {
+        books[instrument].setAuction(true);
+    }
+
+    template<typename Fn>
+    void forEachLastTrade(Fn fn) {
+        for(int i=0;i<MAX_INSTRUMENTS;i++) {
+            Ticks price = lastTrade[i].load(memory_order_relaxed);
+            if(price > 0) fn(i, price);
+        }
+    }
+
+    void restoreLastTrade(int instrument, Ticks price) {
+        lastTrade[instrument].store(price, memory_order_relaxed);
+    }
+
+    template<typename Fn>
+    void forEachRestingOrder(Fn fn) {
+        for(auto& book:books) {
+            book.forEachOrder(fn);
+        }
+    }
+
+    // Publishes every non-empty level, so market data starts from the recovered books
+    void republishBooks() {
+        if(marketData == nullptr) return;
+        for(int i=0;i<(int)books.size();i++) {
+            books[i].forEachLevel([this, i](OrderType side, Ticks price, Qty) {
+                publishLevel(make_tuple(i, side, price));
+            });
+        }
+    }
+
+    void process(const OrderRequest& req) {
+        // Live orders were reserved by the pre-trade check before they were journaled
+        if(replaying && req.type == NewOrder) {
+            if(auto acc = accounts->get(req.accountId)) acc->forceReserve(req.orderType, req.instrument, req.quantity + req.hiddenQuantity, req.price * req.tickSize);
+        }
+        bool deferred = req.type == NewOrder && req.deferMatch && req.timeInForce == GoodTillCancel;
+        if(!deferred) flushDeferred();
+        bool accepted = true;
+        switch(req.type) {
+            case NewOrder:
+                if(deferred) addOrderDeferred(req);
+                else addOrder(req);
+                break;
+            case CancelOrder: accepted = cancelOrder(req.orderId, req.instrument, req.accountId); break;
+            case ReplaceOrder: accepted = replaceOrder(req.orderId, req.instrument, req.accountId, req.quantity, req.price); break;
+            case ReduceOrder: accepted = reduceOrder(req.orderId, req.instrument, req.accountId, req.quantity); break;
+            case OpenAuction: openAuction(req.instrument); break;
+            case Uncross: uncross(req.instrument); break;
+        }
+        if(!accepted) emit(OrderReject, req.orderId, req.orderType, req.instrument, req.quantity, req.price, 0);
+        publishTouched();
+        if(deferred && req.batchEnd) flushDeferred();
+    }
+
+    // Rests the order without crossing; the book is swept once per instrument when the batch ends
+    void addOrderDeferred(const OrderRequest& req) {
+        IOrder* order = pool.acquire(req);
+        emit(OrderAck, order, order->quantity, order->price);
+        index.insert(order->orderId, order);
+        books[order->instrument].addOrder(order);
+        touch(order);
+        if(find(pendingSweeps.begin(), pendingSweeps.end(), order->instrument) == pendingSweeps.end()) {
+            pendingSweeps.push_back(order->instrument);
+        }
+    }
+
+    bool hasPendingSweeps() {
+        return !pendingSweeps.empty();
+    }
+
+    void flushDeferred() {
+        for(int instrument:pendingSweeps) {
+            matchOrders(instrument);
+            publishTouched();
+        }
+        pendingSweeps.clear();
+    }
+
+    void addOrder(const OrderRequest& req) {
+        IOrder* order = pool.acquire(req);
+        emit(OrderAck, order, order->leaves(), order->price);
+        auto& book = books[order->instrument];
+        // Nothing crosses during an auction, so an immediate order there never fills
+        if(req.timeInForce == FillOrKill && (book.inAuction() || !book.canFill(order->orderType, order->price, order->leaves()))) {
+            releaseReservation(order, order->leaves());
+            order->status = Cancelled;
+            emit(OrderCancelled, order->orderId, order->orderType, order->instrument, order->leaves(), order->price, 0);
+            pool.release(order);
+            return;
+        }
+        index.insert(order->orderId, order);
+        book.addOrder(order);
+        touch(order);
+        matchOrders(order->instrument);
+        // IOC remainder never rests
+        if(req.timeInForce != GoodTillCancel && index.find(req.orderId) != nullptr) cancelOrder(req.orderId, req.instrument, req.accountId);
+    }
+
+    // Amendments name the ticker they were routed by and the account that sent them; an order
+    // of another instrument on the same shard, or of another account, is treated as unknown
+    IOrder* findOrder(int orderId, int instrument, int accountId) {
+        IOrder* order = index.find(orderId);
+        return order != nullptr && order->instrument == instrument && order->accountId == accountId ? order : nullptr;
+    }
+
+    bool cancelOrder(int orderId, int instrument, int accountId) {
+        IOrder* order = findOrder(orderId, instrument, accountId);
+        if(order == nullptr) return false;
+        books[order->instrument].remove(order);
+        touch(order);
+        releaseReservation(order, order->leaves());
+        order->status = Cancelled;
+        emit(OrderCancelled, orderId, order->orderType, order->instrument, order->leaves(), order->price, 0);
+        retire(order);
+        return true;
+    }
+
+    // Cancel-replace: the order keeps its id but loses time priority and may cross
+    bool replaceOrder(int orderId, int instrument, int accountId, Qty quantity, Ticks price) {
+        IOrder* order = findOrder(orderId, instrument, accountId);
+        if(order == nullptr) return false;
+        if(auto acc = accounts->get(order->accountId)) {
+            if(!acc->adjustReservation(order->orderType, order->instrument, order->leaves(), order->price * order->tickSize,
+                quantity, price * order->tickSize, replaying)) return false;
+        }
+        auto& book = books[order->instrument];
+        book.remove(order);
+        touch(order);
+        // An iceberg is re-sliced from its new total
+        order->quantity = order->displayQuantity > 0 ? min(quantity, order->displayQuantity) : quantity;
+        order->hiddenQuantity = quantity - order->quantity;
+        order->price = price;
+        emit(OrderReplaced, order, quantity, price);
+        book.addOrder(order);
+        touch(order);
+        matchOrders(order->instrument);
+        return true;
+    }
+
+    // Quantity-down amend keeps the order's place in its level; an iceberg gives up hidden
+    // quantity before displayed
+    bool reduceOrder(int orderId, int instrument, int accountId, Qty quantity) {
+        IOrder* order = findOrder(orderId, instrument, accountId);
+        if(order == nullptr || quantity >= order->leaves()) return false;
+        if(quantity <= 0) return cancelOrder(orderId, instrument, accountId);
+        releaseReservation(order, order->leaves() - quantity);
+        auto& book = books[order->instrument];
+        Qty fromHidden = min(order->hiddenQuantity, order->leaves() - quantity);
+        book.reduceHidden(order, fromHidden);
+        book.fill(order, order->leaves() - quantity);
+        touch(order);
+        emit(OrderReduced, order, quantity, order->price);
+        return true;
+    }
+
+    void openAuction(int instrument) {
+        books[instrument].setAuction(true);
+    }
+
+    // Fills the whole equilibrium volume at one price, in price-time priority, iceberg refills
+    // included, then resumes continuous matching
+    void uncross(int instrument) {
+        auto& book = books[instrument];
+        if(!book.inAuction()) return;
+        Ticks price;
+        Qty volume;
+        if(book.equilibrium(price, volume)) {
+            while(volume > 0) {
+                auto bestBuy = book.bestBid()->head;
+                auto bestSell = book.bestAsk()->head;
+                Qty matchedQuantity = min(volume, min(bestBuy->quantity, bestSell->quantity));
+                trade(book, bestBuy, bestSell, matchedQuantity, price);
+                volume -= matchedQuantity;
+            }
+        }
+        book.setAuction(false);
+        matchOrders(instrument);
+    }
+
+    void trade(OrderBook& book, IOrder* buy, IOrder* sell, Qty quantity, Ticks price) {
+        lastTrade[buy->instrument].store(price, memory_order_relaxed);
+        settle(buy, quantity, price);
+        settle(sell, quantity, price);
+        book.fill(buy, quantity);
+        book.fill(sell, quantity);
+        touch(buy);
+        touch(sell);
+        emit(OrderFill, buy, quantity, price, sell->orderId);
+        emit(OrderFill, sell, quantity, price, buy->orderId);
+        if(buy->quantity == 0) refillOrRetire(book, buy);
+        if(sell->quantity == 0) refillOrRetire(book, sell);
+    }
+
+    // A spent iceberg slice is replaced from the reserve at the back of its level, so each
+    // refill loses time priority
+    void refillOrRetire(OrderBook& book, IOrder* order) {
+        if(order->hiddenQuantity == 0) {
+            retire(order);
+            return;
+        }
+        order->quantity = min(order->displayQuantity, order->hiddenQuantity);
+        order->hiddenQuantity -= order->quantity;
+        order->status = Pending;
+        book.requeue(order);
+        touch(order);
+    }
+
+    void matchOrders(int instrument) {
+        auto& book = books[instrument];
+        if(book.inAuction()) return;
+
+        while(book.crossed()) {
+            auto bestBuy = book.bestBid()->head;
+            auto bestSell = book.bestAsk()->head;
+            // The order that was resting first sets the trade price
+            Ticks tradePrice = bestBuy->entered < bestSell->entered ? bestBuy->price : bestSell->price;
+            trade(book, bestBuy, bestSell, min(bestBuy->quantity, bestSell->quantity), tradePrice);
+        }
+    }
+
+    OrderPool::Stats getPoolStats() {
+        return pool.getStats();
+    }
+
+    // Reports delayed by a full report ring
+    uint64_t getDeferredReports() {
+        return deferredReports.load(memory_order_relaxed);
+    }
+
+    // Level updates deferred by a full market data ring and republished later
+    uint64_t getConflatedBookUpdates() {
+        return conflatedBookUpdates.load(memory_order_relaxed);
+    }
+
+    // True while deferred output is waiting for ring space; the shard keeps retrying it even
+    // when no requests arrive
+    bool hasBacklog() {
+        return !staleLevels.empty() || !pendingReports.empty();
+    }
+
+    void flushBacklog() {
+        if(reports != nullptr) flushPendingReports();
+        if(marketData != nullptr) flushStaleLevels();
+    }
+};
+
+const size_t MATCH_BATCH = 256;
+
+// Cuts a torn record off the end of a log, so appends after recovery start on a record
+// boundary instead of behind the partial bytes
+void dropTornTail(const string& path, size_t recordSize) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) return;
+    off_t whole = st.st_size / recordSize * recordSize;
+    if(whole != st.st_size && truncate(path.c_str(), whole) != 0) throw runtime_error("Cannot truncate " + path);
+}
+
+// Write-ahead log of the requests one shard has consumed. Each popped batch is written with
+// one write() and made durable with one fdatasync() before it is matched, so the sync cost
+// is shared by the whole batch. Every snapshotInterval requests the shard's resting orders
+// are snapshotted and a new journal generation is started, which bounds replay time.
+// Recovery loads the newest snapshot and replays the journal of the same generation.
+class ShardJournal {
+    static constexpr uint64_t SNAPSHOT_MAGIC = 0x534e415053484f54ULL;
+
+    struct SnapshotHeader {
+        uint64_t magic;
+        uint64_t generation;
+        uint64_t reportSequence;
+        uint64_t orderCount;
+        uint64_t settlementCount;
+        uint64_t auctionCount;
+        uint64_t lastTradeCount;
+    };
+
+    struct SettlementRecord {
+        int accountId;
+        int instrument;
+        Cash cash;
+        Qty shares;
+    };
+
+    // Keeps the price band and market collar centred on the market after a restart
+    struct LastTradeRecord {
+        int instrument;
+        Ticks price;
+    };
+
+    string dir;
+    int shardId;
+    uint64_t snapshotInterval;
+    uint64_t generation;
+    uint64_t sinceSnapshot;
+    int fd;
+
+    string journalPath(uint64_t gen) {
+        return dir + "/journal-" + to_string(shardId) + "-" + to_string(gen) + ".bin";
+    }
+
+    string snapshotPath() {
+        return dir + "/snapshot-" + to_string(shardId) + ".bin";
+    }
+
+    void openJournal() {
+        fd = open(journalPath(generation).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if(fd < 0) throw runtime_error("Cannot open journal " + journalPath(generation));
+    }
+
+    static void writeAll(int f, const void* data, size_t len) {
+        auto p = static_cast<const char*>(data);
+        while(len > 0) {
+            ssize_t w = write(f, p, len);
+            if(w < 0) {
+                if(errno == EINTR) continue;
+                throw runtime_error("Journal write failed");
+            }
+            p += w;
+            len -= w;
+        }
+    }
+
+    void syncDir() {
+        int dfd = open(dir.c_str(), O_RDONLY);
+        if(dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+
+    void snapshot(MatchingEngine* engine) {
+        vector<OrderRequest> resting;
+        engine->forEachRestingOrder([&resting](IOrder* o) {
+            OrderRequest req{};
+            req.type = NewOrder;
+            req.orderId = o->orderId;
+            req.orderType = o->orderType;
+            req.accountId = o->accountId;
+            req.instrument = o->instrument;
+            req.tickSize = o->tickSize;
+            req.quantity = o->quantity;
+            req.price = o->price;
+            req.displayQuantity = o->displayQuantity;
+            req.hiddenQuantity = o->hiddenQuantity;
+            req.entryTime = o->arrival;
+            resting.push_back(req);
+        });
+        // Restored in arrival order, so bids and asks keep their relative age and a crossed
+        // auction book still knows which side was resting first
+        sort(resting.begin(), resting.end(), [](const OrderRequest& a, const OrderRequest& b) {
+            return a.instrument != b.instrument ? a.instrument < b.instrument : a.entryTime < b.entryTime;
+        });
+        vector<SettlementRecord> settled;
+        engine->forEachSettlement([&settled](int accountId, int instrument, Cash cash, Qty shares) {
+            settled.push_back({accountId, instrument, cash, shares});
+        });
+        // Instruments still in their call auction, stored as OpenAuction requests
+        vector<OrderRequest> auctions;
+        engine->forEachAuction([&auctions](int instrument) {
+            OrderRequest req{};
+            req.type = OpenAuction;
+            req.instrument = instrument;
+            auctions.push_back(req);
+        });
+        vector<LastTradeRecord> lastTrades;
+        engine->forEachLastTrade([&lastTrades](int instrument, Ticks price) {
+            lastTrades.push_back({instrument, price});
+        });
+        SnapshotHeader header{SNAPSHOT_MAGIC, generation + 1, engine->getReportSequence(), resting.size(), settled.size(), auctions.size(),
+            lastTrades.size()};
+
+        string tmp = snapshotPath() + ".tmp";
+        int sfd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(sfd < 0) throw runtime_error("Cannot write snapshot");
+        writeAll(sfd, &header, sizeof(header));
+        writeAll(sfd, resting.data(), resting.size() * sizeof(OrderRequest));
+        writeAll(sfd, settled.data(), settled.size() * sizeof(SettlementRecord));
+        writeAll(sfd, auctions.data(), auctions.size() * sizeof(OrderRequest));
+        writeAll(sfd, lastTrades.data(), lastTrades.size() * sizeof(LastTradeRecord));
+        if(fdatasync(sfd) != 0) throw runtime_error("Snapshot sync failed");
+        close(sfd);
+        // Once the rename is durable the old generation is no longer needed for recovery
+        if(rename(tmp.c_str(), snapshotPath().c_str()) != 0) throw runtime_error("Cannot publish snapshot");
+        syncDir();
+
+        close(fd);
+        unlink(journalPath(generation).c_str());
+        generation++;
+        openJournal();
+        sinceSnapshot = 0;
+    }
+
+public:
+    ShardJournal(string d, int id, uint64_t interval): dir(d), shardId(id), snapshotInterval(interval), generation(0), sinceSnapshot(0), fd(-1) {}
+
+    ~ShardJournal() {
+        if(fd >= 0) close(fd);
+    }
+
+    // Rebuilds the engine's books and returns the highest order id seen
+    int recover(MatchingEngine* engine) {
+        int maxOrderId = 0;
+        engine->setReplaying(true);
+
+        FILE* snap = fopen(snapshotPath().c_str(), "rb");
+        if(snap != nullptr) {
+            SnapshotHeader header;
+            if(fread(&header, sizeof(header), 1, snap) != 1 || header.magic != SNAPSHOT_MAGIC) {
+                fclose(snap);
+                throw runtime_error("Corrupt snapshot " + snapshotPath());
+            }
+            generation = header.generation;
+            engine->setReportSequence(header.reportSequence);
+            OrderRequest req;
+            // Orders are restored without matching, so a crossed auction book comes back as it was
+            for(uint64_t i=0;i<header.orderCount && fread(&req, sizeof(req), 1, snap) == 1;i++) {
+                engine->restoreOrder(req);
+                maxOrderId = max(maxOrderId, req.orderId);
+            }
+            SettlementRecord rec;
+            for(uint64_t i=0;i<header.settlementCount && fread(&rec, sizeof(rec), 1, snap) == 1;i++) {
+                engine->restoreSettlement(rec.accountId, rec.instrument, rec.cash, rec.shares);
+            }
+            for(uint64_t i=0;i<header.auctionCount && fread(&req, sizeof(req), 1, snap) == 1;i++) {
+                engine->restoreAuction(req.instrument);
+            }
+            LastTradeRecord trade;
+            for(uint64_t i=0;i<header.lastTradeCount && fread(&trade, sizeof(trade), 1, snap) == 1;i++) {
+                engine->restoreLastTrade(trade.instrument, trade.price);
+            }
+            fclose(snap);
+        }
+
+        FILE* log = fopen(journalPath(generation).c_str(), "rb");
+        if(log != nullptr) {
+            vector<OrderRequest> batch(MATCH_BATCH);
+            size_t n;
+            // A torn record at the tail was never acknowledged as durable, so it is dropped
+            while((n = fread(batch.data(), sizeof(OrderRequest), batch.size(), log)) > 0) {
+                for(size_t i=0;i<n;i++) {
+                    engine->process(batch[i]);
+                    maxOrderId = max(maxOrderId, batch[i].orderId);
+                    sinceSnapshot++;
+                }
+            }
+            fclose(log);
+        }
+        dropTornTail(journalPath(generation), sizeof(OrderRequest));
+
+        engine->setReplaying(false);
+        engine->republishBooks();
+        openJournal();
+        return maxOrderId;
+    }
+
+    void append(const OrderRequest* reqs, size_t n) {
+        writeAll(fd, reqs, n * sizeof(OrderRequest));
+        if(fdatasync(fd) != 0) throw runtime_error("Journal sync failed");
+        sinceSnapshot += n;
+    }
+
+    // Waits for an open placeOrders group to be swept: the snapshot does not record which
+    // instruments still owe a sweep, so it is only taken between groups
+    void afterBatch(MatchingEngine* engine) {
+        if(sinceSnapshot >= snapshotInterval && !engine->hasPendingSweeps()) snapshot(engine);
+    }
+};
+
+// Cash or share movement made outside matching; instrument -1 means cash
+struct LedgerEntry {
+    int accountId;
+    int instrument;
+    int64_t amount;
+};
+
+// Deposits and withdrawals are rare, so each one is synced on its own. Recovery replays the
+// ledger before the shard journals so accounts are funded when fills are re-settled.
+class LedgerJournal {
     mutex mtx;
+    string path;
+    int fd;
 public:
-    Account(): accountId(id++), balance(0) {}
+    LedgerJournal(string dir): path(dir + "/ledger.bin"), fd(-1) {}
 
-    void depositMoney(double amt) {
-        balance = balance + amt;
+    ~LedgerJournal() {
+        if(fd >= 0) close(fd);
     }
 
-    void debitAmount(double amt) {
-        lock_guard<mutex> lock(mtx);
-        if(balance < amt) {
-            throw logic_error("Insufficient balance");
+    void recover() {
+        FILE* f = fopen(path.c_str(), "rb");
+        if(f != nullptr) {
+            LedgerEntry e;
+            while(fread(&e, sizeof(e), 1, f) == 1) {
+                auto acc = AccountRegistry::getInstance().get(e.accountId);
+                if(acc == nullptr) continue;
+                if(e.instrument < 0) acc->depositMoney(e.amount);
+                else acc->depositShares(e.instrument, e.amount);
+            }
+            fclose(f);
         }
-
-        balance = balance - amt;
+        dropTornTail(path, sizeof(LedgerEntry));
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if(fd < 0) throw runtime_error("Cannot open ledger " + path);
     }
 
-    double getBalance() {
-        return balance.load();
+    void append(const LedgerEntry& e) {
+        lock_guard<mutex> lock(mtx);
+        if(write(fd, &e, sizeof(e)) != (ssize_t)sizeof(e)) throw runtime_error("Ledger write failed");
+        if(fdatasync(fd) != 0) throw runtime_error("Ledger sync failed");
     }
 };
-int Account::id = 1;
 
-class Stock {
-    string ticker;
-    double price;
+// Optional per-shard instrumentation: time from order entry until the shard picks the
+// request up, and time spent matching it
+struct ShardStats {
+    LatencyHistogram queueWait;
+    LatencyHistogram match;
+    atomic<uint64_t> processed{0};
+};
+
+void ProcessOrders(OrderQueue* q, MatchingEngine* engine, ShardJournal* journal, ShardStats* stats) {
+    vector<OrderRequest> batch(MATCH_BATCH);
+    while(running) {
+        size_t n;
+        if(engine->hasBacklog()) {
+            engine->flushBacklog();
+            n = q->tryPopBatch(batch.data(), batch.size());
+            if(n == 0) {
+                this_thread::sleep_for(chrono::microseconds(50));
+                continue;
+            }
+        } else {
+            n = q->popBatch(batch.data(), batch.size(), running);
+            if(n == 0) continue;
+        }
+        if(journal) journal->append(batch.data(), n);
+        for(size_t i=0;i<n;i++) {
+            if(stats) {
+                uint64_t start = nowNanos();
+                engine->process(batch[i]);
+                stats->queueWait.record(start - batch[i].entryTime);
+                stats->match.record(nowNanos() - start);
+            } else {
+                engine->process(batch[i]);
+            }
+        }
+        if(journal) journal->afterBatch(engine);
+        if(stats) stats->processed.fetch_add(n, memory_order_release);
+    }
+    cout<<"Processing thread stopped\n";
+}
+
+// FNV-1a, so a ticker lands on the same shard in every run and on every host
+uint64_t stableHash(const string& key) {
+    uint64_t h = 1469598103934665603ULL;
+    for(unsigned char c:key) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void pinToCore(thread& t, int core) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    pthread_setaffinity_np(t.native_handle(), sizeof(cpu_set_t), &cpus);
+#endif
+}
+
+// One matching thread with its own input queue and books. Every ticker is owned by exactly
+// one shard, so per-symbol ordering stays strict without any locking between shards.
+class MatchingShard {
+    int shardId;
+    int core;
+    OrderQueue queue;
+    ReportQueue reports;
+    MarketDataQueue marketData;
+    MatchingEngine engine;
+    unique_ptr<ShardJournal> journal;
+    unique_ptr<ShardStats> stats;
+    thread worker;
 public:
-    Stock(string tkr, double p): ticker(tkr), price(p) {}
+    MatchingShard(int id, int c, size_t queueCapacity, WaitStrategy ws): shardId(id), core(c), queue(queueCapacity, ws),
+        reports(queueCapacity, WaitStrategy::SpinThenPark), marketData(queueCapacity, WaitStrategy::SpinThenPark), engine(id, &reports, &marketData) {}
 
-    void updatePrice(double p) {
-        price = p;
+    // Must run before start(); returns the highest order id found in the journal
+    int enableJournal(const string& dir, uint64_t snapshotInterval) {
+        journal.reset(new ShardJournal(dir, shardId, snapshotInterval));
+        return journal->recover(&engine);
     }
 
-    double getPrice() {
-        return price;
+    // Must run before start()
+    ShardStats* enableStats() {
+        stats.reset(new ShardStats());
+        return stats.get();
     }
 
-    string getTicker() {
-        return ticker;
+    void start() {
+        worker = thread(ProcessOrders, &queue, &engine, journal.get(), stats.get());
+        if(core >= 0) pinToCore(worker, core);
+    }
+
+    void join() {
+        if(worker.joinable()) worker.join();
+    }
+
+    OrderQueue* getQueue() {
+        return &queue;
+    }
+
+    int getId() {
+        return shardId;
+    }
+
+    ReportQueue* getReports() {
+        return &reports;
+    }
+
+    MarketDataQueue* getMarketData() {
+        return &marketData;
+    }
+
+    Ticks getLastTradePrice(int instrument) {
+        return engine.getLastTradePrice(instrument);
+    }
+
+    OrderPool::Stats getPoolStats() {
+        return engine.getPoolStats();
+    }
+
+    uint64_t getDeferredReports() {
+        return engine.getDeferredReports();
+    }
+
+    uint64_t getConflatedBookUpdates() {
+        return engine.getConflatedBookUpdates();
     }
 };
 
-enum OrderStatus {
-    Pending,
-    Completed,
-    Rejected
+class IExecutionListener {
+public:
+    virtual void onReport(const ExecutionReport& r) = 0;
+    virtual ~IExecutionListener() = default;
 };
 
-enum OrderType {
-    Buy,
-    Sell
+const char* reportTypeToString(ReportType t) {
+    switch(t) {
+        case OrderAck: return "Ack";
+        case OrderFill: return "Fill";
+        case OrderReject: return "Reject";
+        case OrderCancelled: return "Cancelled";
+        case OrderReplaced: return "Replaced";
+        case OrderReduced: return "Reduced";
+    }
+    return "Unknown";
+}
+
+class ConsoleExecutionListener: public IExecutionListener {
+public:
+    virtual void onReport(const ExecutionReport& r) override {
+        cout<<reportTypeToString(r.type)<<" Stock: "<<InstrumentRegistry::getInstance().getTicker(r.instrument)<<" Order Id: "<<r.orderId;
+        if(r.type == OrderFill) cout<<" Counter Order Id: "<<r.counterOrderId;
+        cout<<" Quantity: "<<r.quantity<<" Price: "<<r.price<<" Leaves: "<<r.leavesQuantity<<"\n";
+    }
 };
 
-class IOrder {
+// Appends raw ExecutionReport records, for downstream systems that read fills off disk
+class FileExecutionListener: public IExecutionListener {
+    FILE* file;
 public:
-    static atomic<int> nextId;
-    int orderId;
-    string stockTicker;
-    int quantity;
-    double price;
-    OrderStatus status;
-    OrderType orderType;
-    IOrder(string ticker, int qt, OrderType ot, double p): orderId(nextId.fetch_add(1)), stockTicker(ticker), quantity(qt), status(Pending), orderType(ot), price(p) {
-        cout<<orderId<<"\n";
+    FileExecutionListener(const string& path): file(fopen(path.c_str(), "ab")) {
+        if(file == nullptr) throw runtime_error("Cannot open execution report file");
+    }
+
+    virtual void onReport(const ExecutionReport& r) override {
+        fwrite(&r, sizeof(r), 1, file);
+    }
+
+    ~FileExecutionListener() {
+        fclose(file);
     }
 };
-atomic<int> IOrder::nextId{1};
 
-class OrderQueue {
-    queue<IOrder*> q;
+// Drains every shard's report ring on its own thread and hands reports to listeners, so
+// console or file I/O never runs on a matching thread. Listeners are registered before start().
+class ExecutionReportPublisher {
+    static constexpr size_t DRAIN_BATCH = 256;
+
+    vector<ReportQueue*> sources;
+    vector<IExecutionListener*> listeners;
+    atomic<bool> active;
+    thread worker;
+
+    size_t drainOnce(vector<ExecutionReport>& batch) {
+        size_t total = 0;
+        for(auto src:sources) {
+            size_t n = src->tryPopBatch(batch.data(), batch.size());
+            for(size_t i=0;i<n;i++) {
+                for(auto l:listeners) l->onReport(batch[i]);
+            }
+            total += n;
+        }
+        return total;
+    }
+
+    void run() {
+        vector<ExecutionReport> batch(DRAIN_BATCH);
+        while(active) {
+            if(drainOnce(batch) == 0) this_thread::sleep_for(chrono::microseconds(50));
+        }
+        while(drainOnce(batch) > 0) {}
+    }
+
+public:
+    ExecutionReportPublisher(): active(false) {}
+
+    void addSource(ReportQueue* q) {
+        sources.push_back(q);
+    }
+
+    void subscribe(IExecutionListener* l) {
+        listeners.push_back(l);
+    }
+
+    void start() {
+        active = true;
+        worker = thread(&ExecutionReportPublisher::run, this);
+    }
+
+    void stop() {
+        active = false;
+        if(worker.joinable()) worker.join();
+    }
+};
+
+enum MarketDataType {
+    DepthDelta,
+    TopOfBook
+};
+
+// DepthDelta: new quantity at price on one side of the published depth (0 = level left the
+// depth). TopOfBook: best bid/ask after the change. Sequence numbers are per ticker; a
+// conflating subscriber sees gaps and should treat updates as latest-value per level.
+// A snapshot is tagged with the ticker's current sequence, so the next live update follows
+// it directly and other subscribers see no gap.
+struct MarketDataUpdate {
+    uint64_t sequence;
+    MarketDataType type;
+    OrderType side;
+    Ticks price;
+    Qty quantity;
+    Ticks bidPrice;
+    Qty bidQuantity;
+    Ticks askPrice;
+    Qty askQuantity;
+    int instrument;
+};
+
+// Per-subscriber buffer filled by the publisher thread and drained by the subscriber with
+// poll(). Once more than `capacity` updates are pending, newer updates overwrite the pending
+// update for the same level instead of queueing, so a slow reader costs bounded memory and
+// never holds up the publisher, let alone matching.
+class MarketDataSubscription {
     mutex mtx;
-    condition_variable cond;
+    size_t capacity;
+    // -1 for every instrument
+    int instrument;
+    vector<MarketDataUpdate> pending;
+    unordered_map<string, size_t> pendingByLevel;
+    uint64_t conflated;
+    bool needsSnapshot;
+
+    static string levelKey(const MarketDataUpdate& u) {
+        string key = to_string(u.instrument);
+        key += u.type == TopOfBook ? "|T" : (u.side == OrderType::Buy ? "|B" : "|S");
+        if(u.type == DepthDelta) key += to_string(u.price);
+        return key;
+    }
+
 public:
-    void push(IOrder* order) {
+    MarketDataSubscription(size_t cap, int inst): capacity(cap), instrument(inst), conflated(0), needsSnapshot(true) {}
+
+    bool wants(int inst) {
+        return instrument < 0 || instrument == inst;
+    }
+
+    bool takeSnapshotRequest() {
         lock_guard<mutex> lock(mtx);
-        q.push(order);
-        cond.notify_one();
+        bool s = needsSnapshot;
+        needsSnapshot = false;
+        return s;
     }
 
-    IOrder* pop() {
-        unique_lock<mutex> lock(mtx);
-        cond.wait(lock, [this] { return !q.empty(); });
-        auto order = q.front();
-        q.pop();
-        return order;
+    void deliver(const MarketDataUpdate& u) {
+        lock_guard<mutex> lock(mtx);
+        string key = levelKey(u);
+        auto it = pendingByLevel.find(key);
+        if(pending.size() >= capacity && it != pendingByLevel.end()) {
+            pending[it->second] = u;
+            conflated++;
+            return;
+        }
+        pendingByLevel[key] = pending.size();
+        pending.push_back(u);
     }
 
-    bool empty() {
+    size_t poll(vector<MarketDataUpdate>& out) {
         lock_guard<mutex> lock(mtx);
-        return q.empty();
+        out.clear();
+        out.swap(pending);
+        pendingByLevel.clear();
+        return out.size();
     }
 
-    IOrder* front() {
-        unique_lock<mutex> lock(mtx);
-        cond.wait(lock, [this] {return !q.empty();});
-        return q.front();
+    uint64_t getConflated() {
+        lock_guard<mutex> lock(mtx);
+        return conflated;
     }
 };
 
-class MatchingEngine {
-    unordered_map<string,multimap<double, IOrder*>> buyOrders;
-    unordered_map<string,multimap<double, IOrder*>> sellOrders;
-public:
-    void addOrder(IOrder* order) {
-        cout<<"addOrder- "<<order->orderId<<"\n";
-        if(order->orderType == OrderType::Buy) {
-            buyOrders[order->stockTicker].insert({order->price, order});
+// Rebuilds aggregated books from the shards' level updates on its own thread and turns them
+// into top-of-book and N-level depth deltas for subscribers.
+class MarketDataPublisher {
+    struct SideDepth {
+        map<Ticks, Qty> levels;
+        vector<pair<Ticks, Qty>> published;
+    };
+
+    struct TickerDepth {
+        SideDepth bids;
+        SideDepth asks;
+        uint64_t sequence = 0;
+    };
+
+    size_t depth;
+    vector<MarketDataQueue*> sources;
+    unordered_map<int, TickerDepth> books;
+    mutex subscribersMtx;
+    vector<shared_ptr<MarketDataSubscription>> subscribers;
+    atomic<bool> active;
+    thread worker;
+
+    vector<pair<Ticks, Qty>> topLevels(SideDepth& side, bool isBid) {
+        vector<pair<Ticks, Qty>> top;
+        if(isBid) {
+            for(auto it = side.levels.rbegin(); it != side.levels.rend() && top.size() < depth; ++it) top.push_back(*it);
         } else {
-            sellOrders[order->stockTicker].insert({order->price, order});
+            for(auto it = side.levels.begin(); it != side.levels.end() && top.size() < depth; ++it) top.push_back(*it);
         }
-        matchOrders(order->stockTicker);
+        return top;
     }
 
-    void matchOrders(string ticker) {
-        auto& bOrders = buyOrders[ticker];
-        auto& sOrders = sellOrders[ticker];
-        cout<<"here\n";
+    MarketDataUpdate makeUpdate(int instrument, TickerDepth& book, MarketDataType type, bool snapshot = false) {
+        MarketDataUpdate u{};
+        u.sequence = snapshot ? book.sequence : ++book.sequence;
+        u.type = type;
+        u.instrument = instrument;
+        if(!book.bids.published.empty()) {
+            u.bidPrice = book.bids.published[0].first;
+            u.bidQuantity = book.bids.published[0].second;
+        }
+        if(!book.asks.published.empty()) {
+            u.askPrice = book.asks.published[0].first;
+            u.askQuantity = book.asks.published[0].second;
+        }
+        return u;
+    }
 
-        while(!bOrders.empty() && !sOrders.empty()) {
-            auto bb = bOrders.rbegin();
-            auto bs = sOrders.begin();
-            auto bestBuy = bb->second;
-            auto bestSell = bs->second;
-            cout<<bestBuy->orderId<<"-"<<bestSell->orderId<<"\n";
-            if(bestBuy->price >= bestSell->price) {
-                int matchedQuantity = min(bestBuy->quantity, bestSell->quantity);
-                cout<<"Stock: "<<ticker<<"\nBuy Order Id: "<<bestBuy->orderId<<"\nSell Order Id: "<<bestSell->orderId<<"\nQuantity: "<<matchedQuantity<<"\nPrice: "<<bestSell->price<<"\n";
+    void diffSide(int instrument, TickerDepth& book, SideDepth& side, OrderType s, vector<MarketDataUpdate>& out) {
+        auto top = topLevels(side, s == OrderType::Buy);
+        auto old = side.published;
+        side.published = top;
+        for(auto& level:top) {
+            auto it = find(old.begin(), old.end(), level);
+            if(it != old.end()) continue;
+            auto u = makeUpdate(instrument, book, DepthDelta);
+            u.side = s;
+            u.price = level.first;
+            u.quantity = level.second;
+            out.push_back(u);
+        }
+        for(auto& level:old) {
+            bool stillShown = any_of(top.begin(), top.end(), [&level](const pair<Ticks, Qty>& l) { return l.first == level.first; });
+            if(stillShown) continue;
+            auto u = makeUpdate(instrument, book, DepthDelta);
+            u.side = s;
+            u.price = level.first;
+            u.quantity = 0;
+            out.push_back(u);
+        }
+    }
 
-                bestBuy->quantity -= matchedQuantity;
-                bestSell->quantity -= matchedQuantity;
+    void apply(const BookUpdate& bu, vector<MarketDataUpdate>& out) {
+        auto& book = books[bu.instrument];
+        auto& side = bu.side == OrderType::Buy ? book.bids : book.asks;
+        if(bu.quantity == 0) side.levels.erase(bu.price);
+        else side.levels[bu.price] = bu.quantity;
 
-                if(bestBuy->quantity == 0) bOrders.erase(next(bb).base());
-                if(bestSell->quantity == 0) sOrders.erase(next(bb).base());
-            } else {
-                break;
+        auto oldBid = book.bids.published.empty() ? pair<Ticks, Qty>{0, 0} : book.bids.published[0];
+        auto oldAsk = book.asks.published.empty() ? pair<Ticks, Qty>{0, 0} : book.asks.published[0];
+        size_t before = out.size();
+        diffSide(bu.instrument, book, side, bu.side, out);
+        if(out.size() == before) return;
+
+        auto newBid = book.bids.published.empty() ? pair<Ticks, Qty>{0, 0} : book.bids.published[0];
+        auto newAsk = book.asks.published.empty() ? pair<Ticks, Qty>{0, 0} : book.asks.published[0];
+        if(newBid != oldBid || newAsk != oldAsk) out.push_back(makeUpdate(bu.instrument, book, TopOfBook));
+    }
+
+    void sendSnapshot(MarketDataSubscription* sub) {
+        for(auto& it:books) {
+            if(!sub->wants(it.first)) continue;
+            for(auto s:{OrderType::Buy, OrderType::Sell}) {
+                auto& side = s == OrderType::Buy ? it.second.bids : it.second.asks;
+                for(auto& level:side.published) {
+                    auto u = makeUpdate(it.first, it.second, DepthDelta, true);
+                    u.side = s;
+                    u.price = level.first;
+                    u.quantity = level.second;
+                    sub->deliver(u);
+                }
             }
-        }  
+            sub->deliver(makeUpdate(it.first, it.second, TopOfBook, true));
+        }
     }
-};
 
-void ProcessOrders(OrderQueue* q, MatchingEngine* engine) {
-    while(running) {
-        if(!q->empty()) {
-            auto order = q->pop();
-            cout<<"Popped order: "<<order->orderId<<"\n";
-            engine->addOrder(order);
-        } else {
-            std::this_thread::sleep_for(chrono::milliseconds(10));
+    size_t drainOnce(vector<BookUpdate>& batch, vector<MarketDataUpdate>& out) {
+        vector<shared_ptr<MarketDataSubscription>> subs;
+        {
+            lock_guard<mutex> lock(subscribersMtx);
+            subs = subscribers;
+        }
+        for(auto& sub:subs) {
+            if(sub->takeSnapshotRequest()) sendSnapshot(sub.get());
         }
+
+        size_t total = 0;
+        for(auto src:sources) {
+            size_t n = src->tryPopBatch(batch.data(), batch.size());
+            out.clear();
+            for(size_t i=0;i<n;i++) {
+                apply(batch[i], out);
+            }
+            for(auto& u:out) {
+                for(auto& sub:subs) {
+                    if(sub->wants(u.instrument)) sub->deliver(u);
+                }
+            }
+            total += n;
+        }
+        return total;
+    }
+
+    void run() {
+        vector<BookUpdate> batch(256);
+        vector<MarketDataUpdate> out;
+        while(active) {
+            if(drainOnce(batch, out) == 0) this_thread::sleep_for(chrono::microseconds(50));
+        }
+    }
+
+public:
+    MarketDataPublisher(size_t d = 5): depth(d), active(false) {}
+
+    void addSource(MarketDataQueue* q) {
+        sources.push_back(q);
+    }
+
+    // Empty ticker subscribes to every instrument. The subscription starts with a snapshot.
+    shared_ptr<MarketDataSubscription> subscribe(const string& ticker = "", size_t capacity = 4096) {
+        int instrument = -1;
+        if(!ticker.empty()) {
+            instrument = InstrumentRegistry::getInstance().find(ticker);
+            if(instrument < 0) throw logic_error("stock does not exist");
+        }
+        auto sub = make_shared<MarketDataSubscription>(capacity, instrument);
+        lock_guard<mutex> lock(subscribersMtx);
+        subscribers.push_back(sub);
+        return sub;
     }
-    cout<<"Processing thread stopped\n";
-}
+
+    void start() {
+        active = true;
+        worker = thread(&MarketDataPublisher::run, this);
+    }
+
+    void stop() {
+        active = false;
+        if(worker.joinable()) worker.join();
+    }
+};
 
 void signalHandler(int signal) {
     if(signal == SIGINT) {
@@ -176,13 +2290,27 @@ void signalHandler(int signal) {
     }
 }
 
+struct OrderEntry {
+    Account* account;
+    string ticker;
+    Qty quantity;
+    OrderType side;
+    Ticks price;
+};
+
+const Ticks MARKET_COLLAR_PERCENT = 10;
+// Limit prices further than this from the reference price are rejected at entry
+const Ticks PRICE_BAND_PERCENT = 50;
+
 class Exchange {
     static mutex mtx;
     static Exchange* instance;
     unordered_map<string, Stock*> stocks;
-    unordered_map<int, IOrder*> orders;
+    vector<MatchingShard*> shards;
+    // Shard index per instrument id, from the ticker's stable hash
+    vector<int> routes;
+    unique_ptr<LedgerJournal> ledger;
     Exchange() = default;
-    OrderQueue* oq;
 public:
     static Exchange* getInstance() {
         if(instance == nullptr) {
@@ -194,44 +2322,500 @@ public:
         return instance;
     }
 
-    void setOrderQueue(OrderQueue* o) {
-        oq = o;
+    void setShards(vector<MatchingShard*> s) {
+        shards = s;
+        for(auto& it:stocks) {
+            route(it.second);
+        }
+    }
+
+    // Replays every shard's journal and moves order ids past anything already used
+    void recover(const string& journalDir, uint64_t snapshotInterval) {
+        mkdir(journalDir.c_str(), 0755);
+        ledger.reset(new LedgerJournal(journalDir));
+        ledger->recover();
+        int maxOrderId = 0;
+        for(auto shard:shards) {
+            maxOrderId = max(maxOrderId, shard->enableJournal(journalDir, snapshotInterval));
+        }
+        IOrder::nextId = max(IOrder::nextId.load(), maxOrderId + 1);
+    }
+
+    void route(Stock* st) {
+        if(shards.empty()) return;
+        if(routes.empty()) routes.resize(MAX_INSTRUMENTS);
+        routes[st->getIndex()] = stableHash(st->getTicker()) % shards.size();
+    }
+
+    Stock* findStock(const string& ticker) {
+        auto it = stocks.find(ticker);
+        if(it == stocks.end()) throw logic_error("stock does not exist");
+        return it->second;
+    }
+
+    // The instrument's last trade on its shard, or its listing price until it has traded
+    Ticks referencePrice(Stock* st) {
+        Ticks last = shards.empty() ? 0 : shardFor(st)->getLastTradePrice(st->getIndex());
+        return last > 0 ? last : st->getPrice();
+    }
+
+    bool withinBand(Stock* st, Ticks price) {
+        Ticks ref = referencePrice(st);
+        Ticks band = max<Ticks>(1, ref * PRICE_BAND_PERCENT / 100);
+        return price >= ref - band && price <= ref + band;
+    }
+
+    void admitAmendment(Account* acc) {
+        if(acc == nullptr || AccountRegistry::getInstance().get(acc->getId()) != acc) throw logic_error("account not registered");
+        if(!acc->admitOrder()) throw logic_error("Order rate limit exceeded");
+    }
+
+    MatchingShard* shardFor(Stock* st) {
+        return shards[routes[st->getIndex()]];
+    }
+
+    void submit(Stock* st, OrderRequest& req) {
+        if(shards.empty()) throw runtime_error("No matching shards set");
+        req.instrument = st->getIndex();
+        req.entryTime = nowNanos();
+        shardFor(st)->getQueue()->push(req);
+    }
+
+    void submit(const string& ticker, OrderRequest& req) {
+        submit(findStock(ticker), req);
+    }
+
+    void addAccount(Account* acc) {
+        AccountRegistry::getInstance().add(acc);
+    }
+
+    void depositMoney(Account* acc, Cash amt) {
+        if(amt <= 0) throw invalid_argument("Invalid amount");
+        acc->depositMoney(amt);
+        if(ledger) ledger->append({acc->getId(), -1, amt});
+    }
+
+    void withdrawMoney(Account* acc, Cash amt) {
+        if(amt <= 0) throw invalid_argument("Invalid amount");
+        acc->debitAmount(amt);
+        if(ledger) ledger->append({acc->getId(), -1, -amt});
+    }
+
+    void depositShares(Account* acc, const string& ticker, Qty qty) {
+        Stock* stock = findStock(ticker);
+        if(qty <= 0) throw invalid_argument("Invalid quantity");
+        acc->depositShares(stock->getIndex(), qty);
+        if(ledger) ledger->append({acc->getId(), stock->getIndex(), qty});
+    }
+
+    // Pre-trade risk runs on the caller's thread: a rate check and one CAS reservation against
+    // the account, both lock-free. The shard releases the reservation on fill or cancel.
+    // displayQuantity > 0 makes an iceberg that shows at most that much at a time
+    int placeOrder(Account* acc, const string& ticker, Qty quantity, OrderType ot, Ticks price,
+                   TimeInForce tif = GoodTillCancel, Qty displayQuantity = 0) {
+        if(quantity <= 0 || price <= 0) throw invalid_argument("Invalid quantity or price");
+        if(displayQuantity < 0 || displayQuantity > quantity) throw invalid_argument("Invalid display quantity");
+        Stock* stock = findStock(ticker);
+        if(!withinBand(stock, price)) throw invalid_argument("Price outside the band around the reference price");
+        if(AccountRegistry::getInstance().get(acc->getId()) != acc) throw logic_error("account not registered");
+        if(!acc->admitOrder()) throw logic_error("Order rate limit exceeded");
+        if(!acc->reserve(ot, stock->getIndex(), quantity, price * stock->getTickSize())) {
+            throw logic_error("Insufficient buying power, position or notional limit");
+        }
+
+        OrderRequest req{};
+        req.type = NewOrder;
+        req.orderId = IOrder::nextId.fetch_add(1);
+        req.orderType = ot;
+        req.accountId = acc->getId();
+        req.tickSize = stock->getTickSize();
+        req.quantity = displayQuantity > 0 ? displayQuantity : quantity;
+        req.hiddenQuantity = quantity - req.quantity;
+        req.displayQuantity = displayQuantity;
+        req.price = price;
+        req.timeInForce = tif;
+        submit(stock, req);
+        return req.orderId;
+    }
+
+    // Market orders are IOC limits at a collar around the last trade price, which bounds
+    // both the price walked through and the cash reserved for a buy
+    int placeMarketOrder(Account* acc, const string& ticker, Qty quantity, OrderType ot) {
+        Ticks ref = referencePrice(findStock(ticker));
+        Ticks collar = max<Ticks>(1, ref * MARKET_COLLAR_PERCENT / 100);
+        Ticks price = ot == OrderType::Buy ? ref + collar : max<Ticks>(1, ref - collar);
+        return placeOrder(acc, ticker, quantity, ot, price, ImmediateOrCancel);
+    }
+
+    // Validates and risk-checks a burst of orders, then hands each shard its part with one ring
+    // reservation. The shard rests the whole part before sweeping each touched book once.
+    // Returns the order id per entry, or -1 where the entry was rejected.
+    vector<int> placeOrders(const vector<OrderEntry>& entries) {
+        if(shards.empty()) throw runtime_error("No matching shards set");
+        vector<int> ids(entries.size(), -1);
+        thread_local vector<vector<OrderRequest>> perShard;
+        perShard.resize(shards.size());
+        uint64_t entryTime = nowNanos();
+
+        for(size_t i=0;i<entries.size();i++) {
+            auto& e = entries[i];
+            if(e.quantity <= 0 || e.price <= 0 || e.account == nullptr) continue;
+            auto it = stocks.find(e.ticker);
+            if(it == stocks.end()) continue;
+            Stock* stock = it->second;
+            if(!withinBand(stock, e.price)) continue;
+            if(AccountRegistry::getInstance().get(e.account->getId()) != e.account) continue;
+            if(!e.account->admitOrder()) continue;
+            if(!e.account->reserve(e.side, stock->getIndex(), e.quantity, e.price * stock->getTickSize())) continue;
+
+            OrderRequest req{};
+            req.type = NewOrder;
+            req.orderType = e.side;
+            req.accountId = e.account->getId();
+            req.instrument = stock->getIndex();
+            req.tickSize = stock->getTickSize();
+            req.quantity = e.quantity;
+            req.price = e.price;
+            req.entryTime = entryTime;
+            req.deferMatch = true;
+            // Order id slot remembers the entry index until ids are handed out below
+            req.orderId = (int)i;
+            perShard[routes[stock->getIndex()]].push_back(req);
+        }
+
+        size_t accepted = 0;
+        for(auto& part:perShard) accepted += part.size();
+        int nextId = IOrder::nextId.fetch_add((int)accepted);
+        for(size_t s=0;s<shards.size();s++) {
+            auto& part = perShard[s];
+            if(part.empty()) continue;
+            for(auto& req:part) {
+                ids[req.orderId] = nextId;
+                req.orderId = nextId++;
+            }
+            auto queue = shards[s]->getQueue();
+            size_t chunk = queue->getCapacity() / 2;
+            for(size_t off=0;off<part.size();off+=chunk) {
+                size_t n = min(chunk, part.size() - off);
+                part[off + n - 1].batchEnd = true;
+                queue->pushBatch(part.data() + off, n);
+            }
+            part.clear();
+        }
+        return ids;
+    }
+
+    // Amendments are routed by ticker so they reach the shard that owns the resting order, and
+    // count against the sending account's rate limit like new orders. The shard rejects an
+    // amendment from any account but the order's own.
+    void cancelOrder(Account* acc, const string& ticker, int orderId) {
+        admitAmendment(acc);
+        OrderRequest req{};
+        req.type = CancelOrder;
+        req.orderId = orderId;
+        req.accountId = acc->getId();
+        submit(ticker, req);
+    }
+
+    void replaceOrder(Account* acc, const string& ticker, int orderId, Qty quantity, Ticks price) {
+        if(quantity <= 0 || price <= 0) throw invalid_argument("Invalid quantity or price");
+        Stock* stock = findStock(ticker);
+        if(!withinBand(stock, price)) throw invalid_argument("Price outside the band around the reference price");
+        admitAmendment(acc);
+        OrderRequest req{};
+        req.type = ReplaceOrder;
+        req.orderId = orderId;
+        req.accountId = acc->getId();
+        req.quantity = quantity;
+        req.price = price;
+        submit(stock, req);
     }
 
-    void placeOrder(IOrder* o) {
-        if(!oq) throw runtime_error("No order queue set");
-        if(!stocks.count(o->stockTicker)) throw logic_error("stock does not exist");
-        oq->push(o);
-        cout<<"Pushed Order: "<<o->orderId<<"\n";
+    void reduceOrder(Account* acc, const string& ticker, int orderId, Qty quantity) {
+        if(quantity < 0) throw invalid_argument("Invalid quantity");
+        admitAmendment(acc);
+        OrderRequest req{};
+        req.type = ReduceOrder;
+        req.orderId = orderId;
+        req.accountId = acc->getId();
+        req.quantity = quantity;
+        submit(ticker, req);
     }
 
+    // Opening/closing call: orders for the ticker accumulate without matching until uncross()
+    void openAuction(const string& ticker) {
+        OrderRequest req{};
+        req.type = OpenAuction;
+        submit(ticker, req);
+    }
+
+    void uncross(const string& ticker) {
+        OrderRequest req{};
+        req.type = Uncross;
+        submit(ticker, req);
+    }
+
+    // Journals and snapshots store instrument ids, so stocks must be added in the same order
+    // on every start
     void addStock(Stock* st) {
+        if(stocks.count(st->getTicker())) throw invalid_argument("Stock already exists");
+        st->setIndex(InstrumentRegistry::getInstance().intern(st->getTicker()));
         stocks[st->getTicker()] = st;
+        route(st);
     }
 };
 Exchange* Exchange::instance = nullptr;
 mutex Exchange::mtx;
 
-int main() {
+// Synthetic order flow for --bench. Ratios are relative weights: "add" rests a passive
+// order away from the mid, "match" sends an order priced through the far side of the
+// spread, "cancel" pulls a previously placed order. Passive prices are offset from each
+// symbol's mid by a uniform or (half-)normal distribution with the given spread in ticks.
+struct BenchConfig {
+    int orders = 1000000;
+    int symbols = 16;
+    int shards = max(1u, thread::hardware_concurrency());
+    int accounts = 16;
+    int addRatio = 60;
+    int cancelRatio = 30;
+    int matchRatio = 10;
+    string distribution = "normal";
+    int spread = 20;
+    // Orders per placeOrders call; 1 sends every order through placeOrder
+    int batch = 1;
+    uint64_t seed = 42;
+};
+
+class BenchReportListener: public IExecutionListener {
+public:
+    LatencyHistogram reportLatency;
+    uint64_t fills = 0;
+
+    virtual void onReport(const ExecutionReport& r) override {
+        reportLatency.record(nowNanos() - r.transactTime);
+        if(r.type == OrderFill) fills++;
+    }
+};
+
+BenchConfig parseBenchConfig(int argc, char** argv) {
+    BenchConfig cfg;
+    parseBenchOptions(argc, argv, [&cfg](const string& key, const string& value) {
+        if(key == "orders") cfg.orders = stoi(value);
+        else if(key == "symbols") cfg.symbols = stoi(value);
+        else if(key == "shards") cfg.shards = stoi(value);
+        else if(key == "accounts") cfg.accounts = stoi(value);
+        else if(key == "add") cfg.addRatio = stoi(value);
+        else if(key == "cancel") cfg.cancelRatio = stoi(value);
+        else if(key == "match") cfg.matchRatio = stoi(value);
+        else if(key == "dist") cfg.distribution = value;
+        else if(key == "spread") cfg.spread = stoi(value);
+        else if(key == "batch") cfg.batch = max(1, stoi(value));
+        else if(key == "seed") cfg.seed = stoull(value);
+        else return false;
+        return true;
+    });
+    if(cfg.distribution != "uniform" && cfg.distribution != "normal") throw invalid_argument("dist must be uniform or normal");
+    if(cfg.addRatio + cfg.cancelRatio + cfg.matchRatio <= 0) throw invalid_argument("Ratios must not all be zero");
+    return cfg;
+}
+
+int runBenchmark(const BenchConfig& cfg) {
+    auto exchange = Exchange::getInstance();
+    vector<MatchingShard*> shards;
+    vector<ShardStats*> stats;
+    for(int i=0;i<cfg.shards;i++) {
+        shards.push_back(new MatchingShard(i, i, 1 << 16, WaitStrategy::SpinThenPark));
+        stats.push_back(shards.back()->enableStats());
+    }
+    exchange->setShards(shards);
+
+    const Ticks mid = 10000;
+    vector<string> tickers;
+    for(int i=0;i<cfg.symbols;i++) {
+        tickers.push_back("sym" + to_string(i));
+        exchange->addStock(new Stock(tickers.back(), mid, 1));
+    }
+    vector<Account*> accounts;
+    for(int i=0;i<cfg.accounts;i++) {
+        accounts.push_back(new Account());
+        exchange->addAccount(accounts.back());
+        exchange->depositMoney(accounts.back(), (Cash)1 << 50);
+        for(auto& t:tickers) {
+            exchange->depositShares(accounts.back(), t, (Qty)1 << 40);
+        }
+    }
+
+    BenchReportListener listener;
+    ExecutionReportPublisher publisher;
+    publisher.subscribe(&listener);
+    for(auto shard:shards) {
+        shard->start();
+        publisher.addSource(shard->getReports());
+    }
+    publisher.start();
+
+    mt19937_64 rng(cfg.seed);
+    discrete_distribution<int> opDist({(double)cfg.addRatio, (double)cfg.cancelRatio, (double)cfg.matchRatio});
+    uniform_int_distribution<int> uniformOffset(0, max(0, cfg.spread - 1));
+    normal_distribution<double> normalOffset(0, max(1, cfg.spread) / 2.0);
+    auto offset = [&]() -> Ticks {
+        if(cfg.distribution == "uniform") return uniformOffset(rng);
+        return min<Ticks>(mid - 2, llabs(llround(normalOffset(rng))));
+    };
+    // Resting order ids per symbol with the account that owns each, which cancels it
+    vector<vector<pair<int, Account*>>> live(cfg.symbols);
+    LatencyHistogram enqueue;
+    uint64_t submitted = 0, riskRejects = 0;
+
+    vector<OrderEntry> pending;
+    vector<int> pendingSymbols;
+    auto flushPending = [&]() {
+        uint64_t t0 = nowNanos();
+        auto ids = exchange->placeOrders(pending);
+        uint64_t perOrder = (nowNanos() - t0) / pending.size();
+        for(size_t k=0;k<ids.size();k++) {
+            if(ids[k] < 0) {
+                riskRejects++;
+                continue;
+            }
+            live[pendingSymbols[k]].push_back({ids[k], pending[k].account});
+            enqueue.record(perOrder);
+            submitted++;
+        }
+        pending.clear();
+        pendingSymbols.clear();
+    };
+
+    uint64_t start = nowNanos();
+    for(int i=0;i<cfg.orders;i++) {
+        int sym = rng() % cfg.symbols;
+        Account* acc = accounts[rng() % accounts.size()];
+        int op = opDist(rng);
+        OrderType side = (rng() & 1) ? OrderType::Buy : OrderType::Sell;
+        uint64_t t0 = nowNanos();
+        try {
+            if(op == 1 && !live[sym].empty()) {
+                size_t k = rng() % live[sym].size();
+                exchange->cancelOrder(live[sym][k].second, tickers[sym], live[sym][k].first);
+                live[sym][k] = live[sym].back();
+                live[sym].pop_back();
+            } else {
+                Ticks away = 1 + offset();
+                Ticks price = op == 2 ? (side == OrderType::Buy ? mid + cfg.spread : mid - cfg.spread)
+                                      : (side == OrderType::Buy ? mid - away : mid + away);
+                if(cfg.batch > 1) {
+                    pending.push_back({acc, tickers[sym], 1 + (Qty)(rng() % 100), side, price});
+                    pendingSymbols.push_back(sym);
+                    if((int)pending.size() == cfg.batch) flushPending();
+                    continue;
+                }
+                live[sym].push_back({exchange->placeOrder(acc, tickers[sym], 1 + rng() % 100, side, price), acc});
+            }
+            enqueue.record(nowNanos() - t0);
+            submitted++;
+        } catch(const logic_error&) {
+            riskRejects++;
+        }
+    }
+    if(!pending.empty()) flushPending();
+
+    auto processed = [&stats]() {
+        uint64_t n = 0;
+        for(auto st:stats) n += st->processed.load(memory_order_acquire);
+        return n;
+    };
+    while(processed() < submitted) {
+        this_thread::sleep_for(chrono::microseconds(100));
+    }
+    uint64_t elapsed = nowNanos() - start;
+
+    running = false;
+    for(auto shard:shards) {
+        shard->join();
+    }
+    publisher.stop();
+
+    cout<<"Orders: "<<submitted<<" (risk rejects "<<riskRejects<<"), symbols: "<<cfg.symbols<<", shards: "<<cfg.shards<<", fills: "<<listener.fills<<"\n";
+    cout<<"Throughput: "<<(uint64_t)(submitted * 1e9 / elapsed)<<" orders/s\n";
+    enqueue.print("enqueue");
+    for(size_t i=0;i<stats.size();i++) {
+        stats[i]->queueWait.print("shard " + to_string(i) + " queue wait");
+        stats[i]->match.print("shard " + to_string(i) + " match");
+    }
+    listener.reportLatency.print("report");
+    for(auto shard:shards) {
+        cout<<"shard "<<shard->getId()<<" deferred reports: "<<shard->getDeferredReports()<<", conflated book updates: "<<shard->getConflatedBookUpdates()<<"\n";
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
     try {
         signal(SIGINT, signalHandler);
-        OrderQueue* oq = new OrderQueue();
-        MatchingEngine* me = new MatchingEngine();
-        thread processingThread(ProcessOrders, oq, me);
+        // --bench [orders=N symbols=N shards=N accounts=N add=W cancel=W match=W dist=uniform|normal spread=T batch=N seed=S]
+        if(argc > 1 && string(argv[1]) == "--bench") return runBenchmark(parseBenchConfig(argc, argv));
+
+        int cores = max(1u, thread::hardware_concurrency());
+        vector<MatchingShard*> shards;
+        for(int i=0;i<cores;i++) {
+            shards.push_back(new MatchingShard(i, i, 1 << 16, WaitStrategy::SpinThenPark));
+        }
 
         auto exchange = Exchange::getInstance();
-        exchange->setOrderQueue(oq);
-        auto apple = new Stock("apl", 100);
+        exchange->setShards(shards);
+        auto apple = new Stock("apl", 10000, 1);
         exchange->addStock(apple);
+        auto buyer = new Account();
+        auto seller = new Account(RiskLimits{toCash(5000), toCash(20000), 100});
+        exchange->addAccount(buyer);
+        exchange->addAccount(seller);
+        // Optional journal directory: books survive a restart and are rebuilt from it
+        if(argc > 1) exchange->recover(argv[1], 100000);
+        for(auto shard:shards) {
+            shard->start();
+        }
+        exchange->depositMoney(buyer, toCash(2000));
+        exchange->depositShares(seller, "apl", 20);
+
+        ExecutionReportPublisher publisher;
+        ConsoleExecutionListener console;
+        publisher.subscribe(&console);
+        for(auto shard:shards) {
+            publisher.addSource(shard->getReports());
+        }
+        publisher.start();
+
+        MarketDataPublisher marketData(5);
+        for(auto shard:shards) {
+            marketData.addSource(shard->getMarketData());
+        }
+        auto appleDepth = marketData.subscribe("apl");
+        marketData.start();
+
+        exchange->openAuction("apl");
+        int order1 = exchange->placeOrder(buyer, "apl", 10, OrderType::Buy, apple->toTicks(99));
+        int order2 = exchange->placeOrder(seller, "apl", 9, OrderType::Sell, apple->toTicks(99));
+        cout<<order1<<"-"<<order2<<"\n";
+        exchange->uncross("apl");
+        int order3 = exchange->placeOrder(seller, "apl", 5, OrderType::Sell, apple->toTicks(101));
+        exchange->reduceOrder(seller, "apl", order3, 3);
+        exchange->cancelOrder(seller, "apl", order3);
 
-        auto order1 = new IOrder("apl", 10, OrderType::Buy, 99);
-        exchange->placeOrder(order1);
-        
-        auto order2 = new IOrder("apl", 9, OrderType::Sell, 99);
-        cout<<order1->orderId<<"-"<<order2->orderId<<"\n";
-        exchange->placeOrder(order2);
+        for(auto shard:shards) {
+            shard->join();
+        }
+        publisher.stop();
+        marketData.stop();
 
-        processingThread.join();
+        vector<MarketDataUpdate> updates;
+        appleDepth->poll(updates);
+        for(auto& u:updates) {
+            const string& ticker = InstrumentRegistry::getInstance().getTicker(u.instrument);
+            if(u.type == TopOfBook) cout<<"Top of book "<<ticker<<" #"<<u.sequence<<": "<<u.bidQuantity<<"@"<<u.bidPrice<<" / "<<u.askQuantity<<"@"<<u.askPrice<<"\n";
+            else cout<<"Depth "<<ticker<<" #"<<u.sequence<<": "<<(u.side == OrderType::Buy ? "bid " : "ask ")<<u.quantity<<"@"<<u.price<<"\n";
+        }
+        cout<<"Buyer balance: "<<buyer->getBalance()<<" buying power: "<<buyer->getBuyingPower()<<" position: "<<buyer->getPosition(apple->getIndex())<<"\n";
+        cout<<"Seller balance: "<<seller->getBalance()<<" buying power: "<<seller->getBuyingPower()<<" position: "<<seller->getPosition(apple->getIndex())<<"\n";
         cout<<"Shutting down\n";
 
     } catch (const exception& e) {
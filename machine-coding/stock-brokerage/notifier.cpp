@@ -14,11 +14,43 @@
 #include <map>
 #include <thread>
 #include <csignal>
+#include <memory>
+#include <chrono>
+#include <sstream>
+#include <random>
+#include <cmath>
+#include <new>
+#include "bench.h"
 
 using namespace std;
 
+// Heap allocations made by the current thread, so --bench can report allocations per event
+// on the publishing thread without every other thread contending on a shared counter.
+// The counting new/delete pair forwards to the library's aligned pair, so allocation and
+// release always go through matching functions.
+thread_local uint64_t threadAllocations = 0;
+
+void* operator new(size_t size) {
+    threadAllocations++;
+    return ::operator new(size, align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+
+void operator delete(void* p) noexcept {
+    ::operator delete(p, align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+
+void operator delete(void* p, size_t) noexcept {
+    ::operator delete(p, align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+
+uint64_t nowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 class StockExchange;
 
+const int MAX_STOCKS = 1024;
+
 struct Order {
 public:
     static int nextId;
@@ -33,6 +65,8 @@ int Order::nextId{1};
 class IStockObserver {
 public:
     virtual void update(Order* o) = 0;
+    // ruleIds are the observer's alert rules the trade fired, ascending
+    virtual void onAlert(Order* o, const vector<int>& ruleIds) = 0;
     virtual int getId() = 0;
 };
 
@@ -43,9 +77,545 @@ public:
     virtual void notifyObservers(Order* o) = 0;
 };
 
+// Bounded lock-free MPMC ring (Vyukov): every slot carries a sequence number that tells
+// producers and consumers whose turn it is, so both sides only CAS their own cursor.
+template<typename T>
+class BoundedQueue {
+    struct Slot {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Slot[]> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+public:
+    BoundedQueue(size_t capacity): head(0), tail(0) {
+        size_t size = 2;
+        while(size < capacity) size <<= 1;
+        slots.reset(new Slot[size]);
+        mask = size - 1;
+        for(size_t i=0;i<size;i++) {
+            slots[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    bool tryPush(const T& value) {
+        size_t pos = tail.load(memory_order_relaxed);
+        while(true) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0) {
+                if(tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    slot.value = value;
+                    slot.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(T& value) {
+        size_t pos = head.load(memory_order_relaxed);
+        while(true) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(diff == 0) {
+                if(head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    value = slot.value;
+                    slot.sequence.store(pos + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = head.load(memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// What a full observer queue does with a new event
+enum OverflowPolicy {
+    // Evict the oldest queued event to make room
+    DropOldest,
+    // Keep only the newest overflowed event per ticker, delivered once the queue drains
+    ConflateByTicker,
+    // Wait for the observer to catch up (back-pressures the transaction thread)
+    Block
+};
+
+// Rules of one observer fired by one trade
+struct Alert {
+    Order* order;
+    vector<int> ruleIds;
+};
+
+// Events for one observer. Producers are transaction threads; exactly one pool worker
+// consumes, so an observer sees its events in order. Events carry the Order pointer, and
+// orders must outlive their delivery. Alerts have their own ring, delivered ahead of queued
+// watch events, and overflow by the same policy; a conflated alert carries the rule ids of
+// every alert it replaced.
+class NotificationQueue {
+    IStockObserver* observer;
+    OverflowPolicy policy;
+    BoundedQueue<Order*> ring;
+    BoundedQueue<Alert*> alerts;
+    unique_ptr<atomic<Order*>[]> latest;
+    unique_ptr<atomic<Alert*>[]> latestAlerts;
+    atomic<bool> conflatedPending;
+    atomic<bool> conflatedAlertsPending;
+    atomic<uint64_t> dropped;
+public:
+    NotificationQueue(IStockObserver* o, OverflowPolicy p, size_t capacity): observer(o), policy(p), ring(capacity), alerts(capacity),
+        conflatedPending(false), conflatedAlertsPending(false), dropped(0) {
+        if(policy == ConflateByTicker) {
+            latest.reset(new atomic<Order*>[MAX_STOCKS]);
+            latestAlerts.reset(new atomic<Alert*>[MAX_STOCKS]);
+            for(int i=0;i<MAX_STOCKS;i++) {
+                latest[i].store(nullptr, memory_order_relaxed);
+                latestAlerts[i].store(nullptr, memory_order_relaxed);
+            }
+        }
+    }
+
+    IStockObserver* getObserver() {
+        return observer;
+    }
+
+    uint64_t getDropped() {
+        return dropped.load(memory_order_relaxed);
+    }
+
+    void enqueue(Order* o, int stockIndex) {
+        switch(policy) {
+            case Block:
+                while(!ring.tryPush(o)) this_thread::yield();
+                break;
+            case DropOldest: {
+                Order* oldest;
+                while(!ring.tryPush(o)) {
+                    if(ring.tryPop(oldest)) dropped.fetch_add(1, memory_order_relaxed);
+                }
+                break;
+            }
+            case ConflateByTicker:
+                // Once a ticker has overflowed, its later events conflate too, so they are never
+                // delivered ahead of the pending one
+                if(latest[stockIndex].load(memory_order_acquire) == nullptr && ring.tryPush(o)) return;
+                if(latest[stockIndex].exchange(o, memory_order_acq_rel) != nullptr) dropped.fetch_add(1, memory_order_relaxed);
+                conflatedPending.store(true, memory_order_release);
+                break;
+        }
+    }
+
+    void enqueueAlert(Alert* a, int stockIndex) {
+        switch(policy) {
+            case Block:
+                while(!alerts.tryPush(a)) this_thread::yield();
+                break;
+            case DropOldest: {
+                Alert* oldest;
+                while(!alerts.tryPush(a)) {
+                    if(alerts.tryPop(oldest)) {
+                        delete oldest;
+                        dropped.fetch_add(1, memory_order_relaxed);
+                    }
+                }
+                break;
+            }
+            case ConflateByTicker: {
+                if(latestAlerts[stockIndex].load(memory_order_acquire) == nullptr && alerts.tryPush(a)) return;
+                // A pending alert is taken back and folded into the new one before it is
+                // published, so the worker never sees an alert that is still being merged
+                Alert* pending = nullptr;
+                while(!latestAlerts[stockIndex].compare_exchange_weak(pending, a, memory_order_acq_rel)) {
+                    if(pending != nullptr && latestAlerts[stockIndex].compare_exchange_strong(pending, nullptr, memory_order_acq_rel)) {
+                        a->ruleIds.insert(a->ruleIds.end(), pending->ruleIds.begin(), pending->ruleIds.end());
+                        sort(a->ruleIds.begin(), a->ruleIds.end());
+                        a->ruleIds.erase(unique(a->ruleIds.begin(), a->ruleIds.end()), a->ruleIds.end());
+                        delete pending;
+                        dropped.fetch_add(1, memory_order_relaxed);
+                    }
+                    pending = nullptr;
+                }
+                conflatedAlertsPending.store(true, memory_order_release);
+                break;
+            }
+        }
+    }
+
+    // Worker side: delivers pending alerts, up to budget queued events, then any conflated
+    // ones once the ring is empty. Returns the number delivered.
+    size_t drain(size_t budget) {
+        size_t delivered = 0;
+        Alert* a;
+        while(delivered < budget && alerts.tryPop(a)) {
+            observer->onAlert(a->order, a->ruleIds);
+            delete a;
+            delivered++;
+        }
+        if(delivered < budget && conflatedAlertsPending.exchange(false, memory_order_acq_rel)) {
+            for(int i=0;i<MAX_STOCKS;i++) {
+                if(latestAlerts[i].load(memory_order_relaxed) == nullptr) continue;
+                Alert* c = latestAlerts[i].exchange(nullptr, memory_order_acq_rel);
+                if(c == nullptr) continue;
+                observer->onAlert(c->order, c->ruleIds);
+                delete c;
+                delivered++;
+            }
+        }
+        Order* o;
+        while(delivered < budget && ring.tryPop(o)) {
+            observer->update(o);
+            delivered++;
+        }
+        if(delivered < budget && conflatedPending.exchange(false, memory_order_acq_rel)) {
+            for(int i=0;i<MAX_STOCKS;i++) {
+                if(latest[i].load(memory_order_relaxed) == nullptr) continue;
+                Order* c = latest[i].exchange(nullptr, memory_order_acq_rel);
+                if(c == nullptr) continue;
+                observer->update(c);
+                delivered++;
+            }
+        }
+        return delivered;
+    }
+};
+
+// Worker pool serving the observer queues. Each queue is pinned to one worker by observer
+// id. Producers never wake a worker, so enqueueing stays lock-free; idle workers poll.
+class NotificationDispatcher {
+    static constexpr size_t DRAIN_BUDGET = 64;
+
+    struct Worker {
+        mutex mtx;
+        vector<NotificationQueue*> queues;
+        atomic<uint64_t> version{0};
+        thread th;
+    };
+
+    vector<unique_ptr<Worker>> workers;
+    atomic<bool> active;
+
+    void run(Worker* w) {
+        vector<NotificationQueue*> local;
+        uint64_t seen = UINT64_MAX;
+        while(true) {
+            bool stopping = !active.load(memory_order_acquire);
+            if(w->version.load(memory_order_acquire) != seen) {
+                lock_guard<mutex> lock(w->mtx);
+                local = w->queues;
+                seen = w->version.load(memory_order_relaxed);
+            }
+            size_t delivered = 0;
+            for(auto q:local) {
+                delivered += q->drain(DRAIN_BUDGET);
+            }
+            // Stops only after a pass that found nothing left to deliver
+            if(delivered == 0) {
+                if(stopping) break;
+                this_thread::sleep_for(chrono::microseconds(50));
+            }
+        }
+    }
+
+public:
+    NotificationDispatcher(int threads): active(true) {
+        for(int i=0;i<max(1, threads);i++) {
+            workers.emplace_back(new Worker());
+            workers.back()->th = thread(&NotificationDispatcher::run, this, workers.back().get());
+        }
+    }
+
+    void attach(NotificationQueue* q) {
+        auto& w = workers[q->getObserver()->getId() % workers.size()];
+        lock_guard<mutex> lock(w->mtx);
+        w->queues.push_back(q);
+        w->version.fetch_add(1, memory_order_release);
+    }
+
+    // Delivers everything already queued, then joins the workers
+    void stop() {
+        active = false;
+        for(auto& w:workers) {
+            if(w->th.joinable()) w->th.join();
+        }
+    }
+};
+
+// Immutable array of the queues watching one ticker. Writers copy it, change the copy and
+// publish it; notifyObservers scans whichever snapshot it loaded.
+struct SubscriberSnapshot {
+    vector<NotificationQueue*> queues;
+};
+
 struct ObserverList {
-    list<IStockObserver*> lst;
-    unordered_map<int, list<IStockObserver*>::iterator> mp;
+    atomic<SubscriberSnapshot*> snapshot;
+    ObserverList(): snapshot(new SubscriberSnapshot()) {}
+};
+
+// Epoch-based reclamation of replaced snapshots. A reader publishes the epoch it entered at
+// in its own slot; a snapshot retired at epoch e is freed once every reader still inside
+// entered at e or later, since those readers can only have loaded its replacement.
+class SnapshotReclaimer {
+    static constexpr int MAX_READERS = 128;
+
+    struct alignas(64) ReaderSlot {
+        atomic<uint64_t> epoch{0};
+    };
+
+    ReaderSlot slots[MAX_READERS];
+    atomic<int> nextSlot{0};
+    atomic<uint64_t> epoch{1};
+    mutex mtx;
+    vector<pair<uint64_t, SubscriberSnapshot*>> retired;
+
+    ReaderSlot& mySlot() {
+        thread_local int slot = -1;
+        if(slot < 0) {
+            slot = nextSlot.fetch_add(1);
+            if(slot >= MAX_READERS) throw length_error("Too many notifying threads");
+        }
+        return slots[slot];
+    }
+
+public:
+    class ReadGuard {
+        ReaderSlot& slot;
+    public:
+        ReadGuard(SnapshotReclaimer& r): slot(r.mySlot()) {
+            slot.epoch.store(r.epoch.load());
+        }
+        ~ReadGuard() {
+            slot.epoch.store(0, memory_order_release);
+        }
+    };
+
+    // Called after the replacement is published
+    void retire(SubscriberSnapshot* old) {
+        lock_guard<mutex> lock(mtx);
+        retired.push_back({epoch.fetch_add(1) + 1, old});
+        uint64_t oldest = UINT64_MAX;
+        for(auto& s:slots) {
+            uint64_t e = s.epoch.load();
+            if(e != 0) oldest = min(oldest, e);
+        }
+        auto keep = remove_if(retired.begin(), retired.end(), [oldest](const pair<uint64_t, SubscriberSnapshot*>& r) {
+            if(r.first > oldest) return false;
+            delete r.second;
+            return true;
+        });
+        retired.erase(keep, retired.end());
+    }
+};
+
+// Subscriptions are patterns over the topic "<sector>.<ticker>". The sector part is a name
+// or "*"; the ticker part is a name, a prefix ending in "*", or "*". A lone "*" matches
+// every topic. Resolving a topic walks at most two paths (its own sector and the any-sector
+// branch) one character at a time, so the cost follows the topic length, not the number of
+// subscriptions.
+class SubscriptionTrie {
+    struct Node {
+        unordered_map<char, unique_ptr<Node>> children;
+        vector<NotificationQueue*> exact;
+        vector<NotificationQueue*> prefix;
+    };
+
+    Node root;
+    // Topics of every sector continue from here, past the '.'
+    Node anySector;
+
+    static Node* child(Node* n, char c, bool create) {
+        auto it = n->children.find(c);
+        if(it != n->children.end()) return it->second.get();
+        if(!create) return nullptr;
+        return (n->children[c] = unique_ptr<Node>(new Node())).get();
+    }
+
+    Node* walk(Node* n, const string& s, bool create) {
+        for(char c:s) {
+            if((n = child(n, c, create)) == nullptr) return nullptr;
+        }
+        return n;
+    }
+
+    // Subscriber list a pattern lives in, or nullptr when absent and create is false
+    vector<NotificationQueue*>* slot(const string& pattern, bool create) {
+        string sector, ticker;
+        bool isPrefix;
+        parse(pattern, sector, ticker, isPrefix);
+        Node* n = sector == "*" ? &anySector : walk(&root, sector + ".", create);
+        if(n != nullptr) n = walk(n, ticker, create);
+        if(n == nullptr) return nullptr;
+        return isPrefix ? &n->prefix : &n->exact;
+    }
+
+    static void collect(Node* n, const string& ticker, vector<NotificationQueue*>& out) {
+        for(size_t i=0;n != nullptr;i++) {
+            out.insert(out.end(), n->prefix.begin(), n->prefix.end());
+            if(i == ticker.size()) {
+                out.insert(out.end(), n->exact.begin(), n->exact.end());
+                return;
+            }
+            n = child(n, ticker[i], false);
+        }
+    }
+
+public:
+    static void parse(const string& pattern, string& sector, string& ticker, bool& isPrefix) {
+        string p = pattern == "*" ? "*.*" : pattern;
+        size_t dot = p.find('.');
+        if(dot == string::npos || dot == 0 || dot + 1 == p.size()) throw invalid_argument("Invalid topic pattern");
+        sector = p.substr(0, dot);
+        ticker = p.substr(dot + 1);
+        if(sector != "*" && sector.find('*') != string::npos) throw invalid_argument("Invalid topic pattern");
+        if(ticker.find('.') != string::npos || ticker.find('*') < ticker.size() - 1) throw invalid_argument("Invalid topic pattern");
+        isPrefix = ticker.back() == '*';
+        if(isPrefix) ticker.pop_back();
+    }
+
+    static bool matches(const string& pattern, const string& sector, const string& ticker) {
+        string ps, pt;
+        bool isPrefix;
+        parse(pattern, ps, pt, isPrefix);
+        if(ps != "*" && ps != sector) return false;
+        return isPrefix ? ticker.compare(0, pt.size(), pt) == 0 : ticker == pt;
+    }
+
+    // false if the queue already holds this pattern
+    bool add(const string& pattern, NotificationQueue* q) {
+        auto subs = slot(pattern, true);
+        if(find(subs->begin(), subs->end(), q) != subs->end()) return false;
+        subs->push_back(q);
+        return true;
+    }
+
+    bool remove(const string& pattern, NotificationQueue* q) {
+        auto subs = slot(pattern, false);
+        if(subs == nullptr) return false;
+        auto it = find(subs->begin(), subs->end(), q);
+        if(it == subs->end()) return false;
+        subs->erase(it);
+        return true;
+    }
+
+    // Every queue whose pattern matches the topic; a queue with several matching patterns is
+    // listed once per pattern
+    void resolve(const string& sector, const string& ticker, vector<NotificationQueue*>& out) {
+        collect(walk(&root, sector + ".", false), ticker, out);
+        collect(&anySector, ticker, out);
+    }
+};
+
+enum AlertType {
+    PriceAbove,
+    PriceBelow,
+    // Either way by value percent from the price when armed; re-arms around the trigger price
+    PercentMove,
+    // Price moves to the other side of the session VWAP
+    VwapCross
+};
+
+struct AlertRule {
+    int id;
+    NotificationQueue* queue;
+    AlertType type;
+    double value;
+    multimap<double, AlertRule*>::iterator upIt;
+    multimap<double, AlertRule*>::iterator downIt;
+    bool hasUp;
+    bool hasDown;
+};
+
+// Alert rules of one ticker, keyed by the price at which they fire. A trade moving the price
+// from last to p only visits the rules with a bound in (last, p] or [p, last), and VWAP
+// rules only when the price changes side of the VWAP, so the work per trade follows the
+// number of triggered rules rather than the number registered.
+class AlertBook {
+    mutex mtx;
+    multimap<double, AlertRule*> upward;
+    multimap<double, AlertRule*> downward;
+    vector<AlertRule*> vwapRules;
+    unordered_map<int, AlertRule*> rules;
+    double lastPrice;
+    double notional;
+    double volume;
+    int vwapSide;
+    vector<AlertRule*> fired;
+
+    void arm(AlertRule* r, double ref) {
+        double up = r->type == PriceAbove ? r->value : ref + ref * r->value / 100;
+        double down = r->type == PriceBelow ? r->value : ref - ref * r->value / 100;
+        r->hasUp = r->type != PriceBelow;
+        r->hasDown = r->type != PriceAbove;
+        if(r->hasUp) r->upIt = upward.insert({up, r});
+        if(r->hasDown) r->downIt = downward.insert({down, r});
+    }
+
+    void disarm(AlertRule* r) {
+        if(r->hasUp) upward.erase(r->upIt);
+        if(r->hasDown) downward.erase(r->downIt);
+        r->hasUp = r->hasDown = false;
+    }
+
+public:
+    AlertBook(double price): lastPrice(price), notional(0), volume(0), vwapSide(0) {}
+
+    void add(AlertRule* r) {
+        lock_guard<mutex> lock(mtx);
+        rules[r->id] = r;
+        if(r->type == VwapCross) vwapRules.push_back(r);
+        else arm(r, lastPrice);
+    }
+
+    bool remove(int id) {
+        lock_guard<mutex> lock(mtx);
+        auto it = rules.find(id);
+        if(it == rules.end()) return false;
+        AlertRule* r = it->second;
+        if(r->type == VwapCross) vwapRules.erase(find(vwapRules.begin(), vwapRules.end(), r));
+        else disarm(r);
+        rules.erase(it);
+        delete r;
+        return true;
+    }
+
+    // Appends the queue and id of every rule the trade triggered
+    void evaluate(Order* o, vector<pair<NotificationQueue*, int>>& out) {
+        lock_guard<mutex> lock(mtx);
+        double p = o->price;
+        fired.clear();
+        if(p > lastPrice) {
+            for(auto it = upward.upper_bound(lastPrice); it != upward.end() && it->first <= p; ++it) fired.push_back(it->second);
+        } else if(p < lastPrice) {
+            for(auto it = downward.lower_bound(p); it != downward.end() && it->first < lastPrice; ++it) fired.push_back(it->second);
+        }
+        if(volume > 0) {
+            double vwap = notional / volume;
+            int side = p > vwap ? 1 : (p < vwap ? -1 : 0);
+            if(side != 0 && vwapSide != 0 && side != vwapSide) fired.insert(fired.end(), vwapRules.begin(), vwapRules.end());
+            if(side != 0) vwapSide = side;
+        }
+        notional += p * o->quantity;
+        volume += o->quantity;
+        lastPrice = p;
+
+        for(auto r:fired) {
+            if(r->type == PercentMove) {
+                disarm(r);
+                arm(r, p);
+            }
+            out.push_back({r->queue, r->id});
+        }
+    }
 };
 
 class Account {
@@ -54,6 +624,10 @@ public:
     int accountId;
     Account(): accountId(nextId++) {}
     virtual void displayAccountInfo() = 0;
+    // Accounts that take stock notifications return themselves
+    virtual IStockObserver* asObserver() {
+        return nullptr;
+    }
 };
 int Account::nextId{1};
 
@@ -72,19 +646,38 @@ public:
         cout<<"Institution Account: "<<accountId<<"\n";
     }
 
+    // Called from a notification worker; built first so concurrent workers don't interleave
     virtual void update(Order* o) override {
-        cout<<"Account Id: "<<accountId<<"\nNotified for stock: "<<o->ticker<<"\nPrice: "<<o->price<<"\n";
+        ostringstream out;
+        out<<"Account Id: "<<accountId<<"\nNotified for stock: "<<o->ticker<<"\nPrice: "<<o->price<<"\n";
+        cout<<out.str();
+    }
+
+    virtual void onAlert(Order* o, const vector<int>& ruleIds) override {
+        ostringstream out;
+        out<<"Account Id: "<<accountId<<"\nAlert for stock: "<<o->ticker<<"\nPrice: "<<o->price<<"\nRules:";
+        for(int id:ruleIds) {
+            out<<" "<<id;
+        }
+        out<<"\n";
+        cout<<out.str();
     }
 
     virtual int getId() override {
         return accountId;
     }
+
+    virtual IStockObserver* asObserver() override {
+        return this;
+    }
 };
 
 struct Stock {
     string ticker;
+    string sector;
     double price;
-    Stock(string t, double p): ticker(t), price(p) {}
+    int index;
+    Stock(string t, double p, string s = "general"): ticker(t), sector(s), price(p), index(-1) {}
 };
 
 class StockExchange: public IStockSubject {
@@ -93,7 +686,45 @@ class StockExchange: public IStockSubject {
     
     unordered_map<string, ObserverList*> observers;
     unordered_map<string, Stock*> stocks;
-    StockExchange() = default;
+    unordered_map<int, NotificationQueue*> queues;
+    SubscriptionTrie subscriptions;
+    unordered_map<string, AlertBook*> alerts;
+    atomic<int> nextAlertId{1};
+    // Serialises subscription changes; notification never takes it
+    mutex writeMtx;
+    SnapshotReclaimer reclaimer;
+    NotificationDispatcher dispatcher;
+    StockExchange(): dispatcher(max(1u, thread::hardware_concurrency())) {}
+
+    NotificationQueue* queueFor(IStockObserver* o) {
+        auto it = queues.find(o->getId());
+        if(it != queues.end()) return it->second;
+        return createQueue(o, ConflateByTicker, 1024);
+    }
+
+    // Re-resolves the cached fan-out of every stock the pattern covers. Snapshots are only
+    // rebuilt here, so publishing never touches the trie.
+    void refresh(const string& pattern) {
+        for(auto& it:stocks) {
+            Stock* st = it.second;
+            if(!SubscriptionTrie::matches(pattern, st->sector, st->ticker)) continue;
+            auto next = new SubscriberSnapshot();
+            subscriptions.resolve(st->sector, st->ticker, next->queues);
+            sort(next->queues.begin(), next->queues.end());
+            next->queues.erase(unique(next->queues.begin(), next->queues.end()), next->queues.end());
+            auto obs = observers[st->ticker];
+            SubscriberSnapshot* current = obs->snapshot.load();
+            obs->snapshot.store(next);
+            reclaimer.retire(current);
+        }
+    }
+
+    NotificationQueue* createQueue(IStockObserver* o, OverflowPolicy policy, size_t capacity) {
+        auto q = new NotificationQueue(o, policy, capacity);
+        queues[o->getId()] = q;
+        dispatcher.attach(q);
+        return q;
+    }
 public:
     static StockExchange* getInstance() {
         if(instance == nullptr) {
@@ -106,62 +737,148 @@ public:
     }
 
     void addStock(Stock* s) {
+        if(s->ticker.find_first_of(".*") != string::npos || s->sector.find_first_of(".*") != string::npos) {
+            throw invalid_argument("Ticker and sector cannot contain '.' or '*'");
+        }
+        if(stocks.count(s->ticker)) throw invalid_argument("Stock already exists");
+        if(stocks.size() >= MAX_STOCKS) throw length_error("Too many stocks");
+        s->index = stocks.size();
         stocks[s->ticker] = s;
         observers[s->ticker] = new ObserverList();
+        alerts[s->ticker] = new AlertBook(s->price);
+        lock_guard<mutex> lock(writeMtx);
+        refresh(s->sector + "." + s->ticker);
     }
 
     virtual void addObserver(string ticker, IStockObserver* o) override {
         if(!stocks.count(ticker)) throw invalid_argument("Invalid stock");
-        auto obs = observers[ticker];
-        if(obs->mp.count(o->getId())) {
+        subscribe(o, "*." + ticker);
+    }
+
+    virtual void removeObserver(string ticker, IStockObserver* o) override {
+        if(!stocks.count(ticker)) throw invalid_argument("Invalid stock");
+        unsubscribe(o, "*." + ticker);
+    }
+
+    void subscribe(IStockObserver* o, const string& pattern) {
+        lock_guard<mutex> lock(writeMtx);
+        if(!subscriptions.add(pattern, queueFor(o))) {
             cout<<"Observer already exists\n";
             return;
         }
-        obs->lst.push_front(o);
-        obs->mp[o->getId()] = obs->lst.begin();
+        refresh(pattern);
     }
 
-    virtual void removeObserver(string ticker, IStockObserver* o) override {
-        if(!stocks.count(ticker)) throw invalid_argument("Invalid stock");
-        auto obs = observers[ticker];
-        if(!obs->mp.count(o->getId())) {
+    void unsubscribe(IStockObserver* o, const string& pattern) {
+        lock_guard<mutex> lock(writeMtx);
+        auto it = queues.find(o->getId());
+        if(it == queues.end() || !subscriptions.remove(pattern, it->second)) {
             cout<<"Observer does not exists\n";
             return;
         }
-
-        auto it = obs->mp[o->getId()];
-        obs->lst.erase(it);
-        obs->mp.erase(o->getId());
+        refresh(pattern);
     }
 
+    // Only enqueues; updates run on the dispatcher's workers
     virtual void notifyObservers(Order* o) override {
-        string ticker = o->ticker;
-        if(!stocks.count(ticker)) throw invalid_argument("Invalid stock");
-        if(!observers.count(ticker)) {
+        auto stock = stocks.find(o->ticker);
+        if(stock == stocks.end()) throw invalid_argument("Invalid stock");
+        auto obs = observers.find(o->ticker);
+        if(obs == observers.end()) {
             cout<<"No one listening";
             return;
         }
-        
-        auto obs = observers[ticker]->lst;
-        for(auto it:obs) {
-            it->update(o);
+
+        int index = stock->second->index;
+        SnapshotReclaimer::ReadGuard guard(reclaimer);
+        SubscriberSnapshot* snapshot = obs->second->snapshot.load();
+        for(auto q:snapshot->queues) {
+            q->enqueue(o, index);
+        }
+    }
+
+    // Must be called before the observer watches its first stock
+    void setDeliveryPolicy(IStockObserver* o, OverflowPolicy policy, size_t capacity = 1024) {
+        lock_guard<mutex> lock(writeMtx);
+        if(queues.count(o->getId())) throw logic_error("Observer already has a delivery queue");
+        createQueue(o, policy, capacity);
+    }
+
+    void shutdown() {
+        dispatcher.stop();
+    }
+
+    uint64_t getDroppedNotifications() {
+        lock_guard<mutex> lock(writeMtx);
+        uint64_t dropped = 0;
+        for(auto& it:queues) {
+            dropped += it.second->getDropped();
         }
+        return dropped;
     }
 
     void watchStock(Account* acc, string ticker) {
-        auto account = dynamic_cast<InstitutionalAccount*>(acc);
-        if(account == nullptr) {
+        watchTopic(acc, "*." + ticker);
+    }
+
+    void watchSector(Account* acc, string sector) {
+        watchTopic(acc, sector + ".*");
+    }
+
+    // See SubscriptionTrie for the pattern syntax, e.g. "tech.*", "*.ap*" or "*"
+    void watchTopic(Account* acc, string pattern) {
+        auto observer = acc->asObserver();
+        if(observer == nullptr) {
             cout<<"Not an institutional investor";
             return;
         }
-        addObserver(ticker, account);
+        subscribe(observer, pattern);
+    }
+
+    // Returns the rule id for removeAlert. Rules fire only when a trade crosses their bound,
+    // independently of any watch subscription.
+    int addAlert(Account* acc, string ticker, AlertType type, double value) {
+        auto observer = acc->asObserver();
+        if(observer == nullptr) throw invalid_argument("Not an institutional investor");
+        auto book = alerts.find(ticker);
+        if(book == alerts.end()) throw invalid_argument("Invalid stock");
+        if(value <= 0) throw invalid_argument("Invalid alert threshold");
+        NotificationQueue* q;
+        {
+            lock_guard<mutex> lock(writeMtx);
+            q = queueFor(observer);
+        }
+        auto rule = new AlertRule{nextAlertId++, q, type, value, {}, {}, false, false};
+        book->second->add(rule);
+        return rule->id;
+    }
+
+    void removeAlert(string ticker, int alertId) {
+        auto book = alerts.find(ticker);
+        if(book == alerts.end()) throw invalid_argument("Invalid stock");
+        if(!book->second->remove(alertId)) cout<<"Alert does not exists\n";
     }
 
     void processTransaction(Order* o) {
         string ticker = o->ticker;
-        if(!stocks.count(ticker)) throw invalid_argument("Invalid stock");
+        auto stock = stocks.find(ticker);
+        if(stock == stocks.end()) throw invalid_argument("Invalid stock");
         // Process transaction
         notifyObservers(o);
+
+        thread_local vector<pair<NotificationQueue*, int>> triggered;
+        triggered.clear();
+        alerts.find(ticker)->second->evaluate(o, triggered);
+        // Several rules of one observer crossed by the same trade arrive as one alert
+        sort(triggered.begin(), triggered.end());
+        for(size_t i=0;i<triggered.size();) {
+            auto alert = new Alert{o, {}};
+            NotificationQueue* q = triggered[i].first;
+            for(;i<triggered.size() && triggered[i].first == q;i++) {
+                alert->ruleIds.push_back(triggered[i].second);
+            }
+            q->enqueueAlert(alert, stock->second->index);
+        }
     }
 };
 StockExchange* StockExchange::instance = nullptr;
@@ -180,11 +897,120 @@ public:
     }
 };
 
-int main() {
+// Institutional observer that records delivery latency instead of printing. Each observer
+// is drained by one worker, so its histogram has a single writer.
+class BenchAccount: public InstitutionalAccount {
+    const vector<uint64_t>& sentAt;
+public:
+    LatencyHistogram latency;
+
+    BenchAccount(const vector<uint64_t>& sent): InstitutionalAccount(), sentAt(sent) {}
+
+    virtual void update(Order* o) override {
+        latency.record(nowNanos() - sentAt[o->orderId]);
+    }
+};
+
+// Synthetic notification load for --bench: every observer watches `watch` tickers, and each
+// event is a trade on a uniformly chosen ticker. rate=0 publishes as fast as possible.
+struct BenchConfig {
+    int observers = 1000;
+    int tickers = 100;
+    int events = 200000;
+    int watch = 10;
+    string policy = "conflate";
+    size_t capacity = 1024;
+    uint64_t rate = 0;
+    uint64_t seed = 42;
+};
+
+BenchConfig parseBenchConfig(int argc, char** argv) {
+    BenchConfig cfg;
+    parseBenchOptions(argc, argv, [&cfg](const string& key, const string& value) {
+        if(key == "observers") cfg.observers = stoi(value);
+        else if(key == "tickers") cfg.tickers = stoi(value);
+        else if(key == "events") cfg.events = stoi(value);
+        else if(key == "watch") cfg.watch = stoi(value);
+        else if(key == "policy") cfg.policy = value;
+        else if(key == "capacity") cfg.capacity = stoull(value);
+        else if(key == "rate") cfg.rate = stoull(value);
+        else if(key == "seed") cfg.seed = stoull(value);
+        else return false;
+        return true;
+    });
+    if(cfg.policy != "drop" && cfg.policy != "conflate" && cfg.policy != "block") throw invalid_argument("policy must be drop, conflate or block");
+    if(cfg.observers <= 0 || cfg.tickers <= 0 || cfg.events <= 0) throw invalid_argument("Counts must be positive");
+    if(cfg.tickers > MAX_STOCKS) throw invalid_argument("Too many tickers");
+    cfg.watch = max(1, min(cfg.watch, cfg.tickers));
+    return cfg;
+}
+
+int runBenchmark(const BenchConfig& cfg) {
+    auto instance = StockExchange::getInstance();
+    vector<string> tickers;
+    for(int i=0;i<cfg.tickers;i++) {
+        tickers.push_back("sym" + to_string(i));
+        instance->addStock(new Stock(tickers.back(), 100));
+    }
+
+    mt19937_64 rng(cfg.seed);
+    vector<Order*> orders;
+    orders.reserve(cfg.events);
+    for(int i=0;i<cfg.events;i++) {
+        orders.push_back(new Order(tickers[rng() % cfg.tickers], 100 + (double)(rng() % 1000) / 100, 1 + rng() % 100));
+    }
+    vector<uint64_t> sentAt(Order::nextId, 0);
+
+    OverflowPolicy policy = cfg.policy == "drop" ? DropOldest : (cfg.policy == "block" ? Block : ConflateByTicker);
+    vector<BenchAccount*> accounts;
+    for(int i=0;i<cfg.observers;i++) {
+        accounts.push_back(new BenchAccount(sentAt));
+        instance->setDeliveryPolicy(accounts.back(), policy, cfg.capacity);
+        for(int w=0;w<cfg.watch;w++) {
+            instance->watchStock(accounts.back(), tickers[(i + (uint64_t)w * cfg.tickers / cfg.watch) % cfg.tickers]);
+        }
+    }
+
+    uint64_t allocationsBefore = threadAllocations;
+    uint64_t start = nowNanos();
+    for(int i=0;i<cfg.events;i++) {
+        if(cfg.rate > 0) {
+            uint64_t due = start + (uint64_t)i * 1000000000ULL / cfg.rate;
+            while(nowNanos() < due) {}
+        }
+        sentAt[orders[i]->orderId] = nowNanos();
+        instance->processTransaction(orders[i]);
+    }
+    uint64_t published = nowNanos();
+    uint64_t allocations = threadAllocations - allocationsBefore;
+    instance->shutdown();
+    uint64_t drained = nowNanos();
+
+    LatencyHistogram all;
+    uint64_t worstP99 = 0;
+    for(auto acc:accounts) {
+        all.merge(acc->latency);
+        worstP99 = max(worstP99, acc->latency.percentile(99));
+    }
+    double publishSecs = (published - start) / 1e9, totalSecs = (drained - start) / 1e9;
+    cout<<"Events: "<<cfg.events<<", tickers: "<<cfg.tickers<<", observers: "<<cfg.observers<<", watch: "<<cfg.watch
+        <<", policy: "<<cfg.policy<<", workers: "<<max(1u, thread::hardware_concurrency())<<"\n";
+    cout<<"Publish: "<<(uint64_t)(cfg.events / publishSecs)<<" events/s, end to end: "<<(uint64_t)(cfg.events / totalSecs)<<" events/s\n";
+    cout<<"Deliveries: "<<all.getCount()<<" ("<<(uint64_t)(all.getCount() / totalSecs)<<"/s), dropped or conflated: "<<instance->getDroppedNotifications()<<"\n";
+    cout<<"Allocations per event on the publishing thread: "<<(double)allocations / cfg.events<<"\n";
+    all.print("delivery latency");
+    cout<<"slowest observer p99: "<<worstP99<<"ns\n";
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    // --bench [observers=N tickers=N events=N watch=N policy=drop|conflate|block capacity=N rate=N seed=S]
+    if(argc > 1 && string(argv[1]) == "--bench") return runBenchmark(parseBenchConfig(argc, argv));
+
     auto instance = StockExchange::getInstance();
-    Stock* apple = new Stock("apl", 100);
-    Stock* google = new Stock("ggl", 50);
-    Stock* amazon = new Stock("amz", 80);
+    Stock* apple = new Stock("apl", 100, "tech");
+    Stock* google = new Stock("ggl", 50, "tech");
+    Stock* amazon = new Stock("amz", 80, "retail");
     instance->addStock(apple);
     instance->addStock(google);
     instance->addStock(amazon);
@@ -193,10 +1019,12 @@ int main() {
     auto ins1 = AccountFactory::createAccount("ins");
     auto ins2 = AccountFactory::createAccount("ins");
     
-    instance->watchStock(ins1, "apl");
-    instance->watchStock(ins1, "ggl");
+    instance->setDeliveryPolicy(ins2->asObserver(), DropOldest, 256);
+    instance->watchSector(ins1, "tech");
     instance->watchStock(ins2, "ggl");
-    instance->watchStock(ins2, "amz");
+    instance->watchTopic(ins2, "*.am*");
+    instance->addAlert(ins2, "apl", PriceAbove, 105);
+    instance->addAlert(ins2, "apl", PercentMove, 5);
     
     auto o1 = new Order("apl", 101, 10);
     instance->processTransaction(o1);
@@ -204,5 +1032,8 @@ int main() {
     instance->processTransaction(o2);
     auto o3 = new Order("amz", 80, 20);
     instance->processTransaction(o3);
+    auto o4 = new Order("apl", 106, 5);
+    instance->processTransaction(o4);
+    instance->shutdown();
 
 }
\ No newline at end of file